@@ -1,11 +1,54 @@
 #ifndef __COMMON_CONFIG_H__
 #define __COMMON_CONFIG_H__
 
+#ifdef __KERNEL__
+#include <linux/build_bug.h>
+#include <linux/stddef.h>
+#include <linux/types.h>
+#else
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#endif
+
 #define DEVICE_NAME "xsp"
-#define CORE_NUM 28
 #define IOCTL_BIND_DEV _IOW('x', 1, struct bind_dev_info)
 #define IOCTL_SEND _IOW('x', 2, uint64_t)
 #define IOCTL_SEND_ALL _IOW('x', 4, uint64_t)
+#define IOCTL_FLOW_ADD _IOW('x', 5, struct flow_rule_info)
+#define IOCTL_FLOW_DEL _IOW('x', 6, struct flow_rule_info)
+#define IOCTL_SEND_BATCH _IOW('x', 7, struct send_batch_info)
+#define IOCTL_PORT_GROUP_SET _IOW('x', 8, struct port_group_info)
+#define IOCTL_UNBIND_DEV _IOW('x', 9, struct unbind_dev_info)
+#define IOCTL_RX_EVENTFD _IOW('x', 10, struct rx_eventfd_info)
+
+// Max entries of a ring, the depth of a ring must be a power of two.
+#define XSP_RING_MAX_DEPTH (1 << 20)
+// Max tx queues of a bound device
+#define XSP_MAX_TX_QUEUE_NUM 1024
+// Limits of the header window of a packet, see bind_dev_info.rx_frame_size
+#define XSP_FRAME_ALIGN 64
+#define XSP_FRAME_MAX_SIZE 2048
+
+// Layout of the region of a binding, see bind_dev_info.region_offset. Each
+// part is at a byte offset in the region, page aligned. The stats come
+// first at 0, writable like the rest of the region. Parts the binding does
+// not have are at 0 as well. Queue slot i of a part is at its offset + i *
+// its stride.
+struct xsp_region_layout {
+    // Bytes of the whole region
+    uint64_t size;
+    // struct xsp_tx_dirty
+    uint64_t tx_dirty;
+    uint64_t rx_queues;
+    uint64_t rx_queue_stride;
+    uint64_t rx_frames;
+    uint64_t rx_frame_stride;
+    uint64_t tx_queues;
+    uint64_t tx_queue_stride;
+    uint64_t tx_comps;
+    uint64_t tx_comp_stride;
+};
 
 struct bind_dev_info {
     // in argument
@@ -14,12 +57,401 @@ struct bind_dev_info {
     unsigned long step;
     // rx out argument
     unsigned long rx_start_offset;
+    // in: requested rx queue number, 0 or at least the number of possible
+    // cpus gives every cpu its own queue. Less queues are shared, the
+    // queue of cpu n is n % rx_queue_num.
+    // out: number of rx queue slots. Per cpu queues have one slot per
+    // possible cpu id, see xsp_queue_stats.state for the ones that have a
+    // queue.
     unsigned long rx_queue_num;
     unsigned long rx_queue_size;
+    // in: requested entries of each rx ring, 0 picks the default.
+    // out: granted entries.
+    unsigned long rx_ring_depth;
     // tx out argument
     unsigned long tx_start_offset;
+    // in: requested tx queue number, 0 picks the number of online cpus.
+    // out: granted number.
     unsigned long tx_queue_num;
     unsigned long tx_queue_size;
+    // in/out: like rx_ring_depth
+    unsigned long tx_ring_depth;
+    // in: XSP_DESC_FORMAT_* of the rx rings. out: the granted format and
+    // its descriptor size, which is the stride of the rx rings.
+    unsigned long rx_desc_format;
+    unsigned long rx_desc_size;
+    // in/out: like rx_desc_format for the tx rings, XSP_DESC_FORMAT_EXT is
+    // struct xsp_tx_desc_ext.
+    unsigned long tx_desc_format;
+    unsigned long tx_desc_size;
+    // in: bytes of the header window of each packet, a multiple of
+    // XSP_FRAME_ALIGN up to XSP_FRAME_MAX_SIZE. 0 disables the frame areas,
+    // they require XSP_DESC_FORMAT_EXT.
+    // out: frame area of rx queue slot i is mapped read-write at
+    // rx_frame_start_offset + i * step, rx_frame_area_size bytes each.
+    unsigned long rx_frame_size;
+    unsigned long rx_frame_start_offset;
+    unsigned long rx_frame_area_size;
+    // stats out argument, see struct xsp_stats_region
+    unsigned long stats_offset;
+    unsigned long stats_size;
+    // in: XSP_BIND_* flags
+    unsigned long flags;
+    // out: struct xsp_tx_dirty mapped read-write with XSP_BIND_TX_DIRTY
+    unsigned long tx_dirty_offset;
+    unsigned long tx_dirty_size;
+    // out: with XSP_BIND_TX_COMPLETION, the completion ring of tx queue i
+    // is mapped at tx_comp_start_offset + i * step, tx_comp_size bytes.
+    unsigned long tx_comp_start_offset;
+    unsigned long tx_comp_size;
+    // in: rx group, 0 for none. The devices of a rx group share the rx
+    // queues of the first one bound, whose rx geometry they get, and tell
+    // apart their packets by the ifindex of their descriptors. Requires
+    // XSP_DESC_FORMAT_IF or XSP_DESC_FORMAT_COMPACT and no frame areas, all
+    // members must request the rx_desc_format of the first one. The
+    // rx counters of the group are kept in the stats region of its first
+    // device.
+    unsigned long rx_group;
+    // in: XSP_DESC_VERSION the descriptor formats of the caller follow, 0 is
+    // taken as 1. Versions newer than the one of the kernel are rejected.
+    // out: XSP_DESC_VERSION of the kernel.
+    unsigned long desc_version;
+    // out: every part of the binding (rings, frame areas, stats, tx dirty
+    // region) is mapped read-write by a single mmap of up to region.size
+    // bytes at region_offset, laid out as described by region. Rx queue
+    // slots without a queue at the time of the mmap are holes, they are
+    // mapped through their own offsets once their cpu comes online. The
+    // parts can still be mapped one by one through their own offsets.
+    unsigned long region_offset;
+    struct xsp_region_layout region;
+};
+
+// Bits of bind_dev_info.flags
+// The tx rings are drained by a kernel thread of the NUMA node of the
+// device instead of IOCTL_SEND. The thread sets XSP_RING_NEED_WAKEUP on
+// the tx rings before it goes idle, userspace then kicks it with
+// IOCTL_SEND or IOCTL_SEND_ALL after submitting.
+#define XSP_BIND_TX_POLL (1 << 0)
+// IOCTL_SEND_ALL only sends the tx rings marked in the struct xsp_tx_dirty
+// of the device, instead of looking at every ring.
+#define XSP_BIND_TX_DIRTY (1 << 1)
+// Every tx ring gets a completion ring of the same depth where the kernel
+// reports what became of each descriptor, see struct xsp_tx_completion.
+#define XSP_BIND_TX_COMPLETION (1 << 2)
+
+// Tx rings with new descriptors. After submitting to tx ring i userspace
+// atomically sets bit i % 64 of words[i / 64] and then bit i / 64 of
+// summary. IOCTL_SEND_ALL clears what it sends.
+struct xsp_tx_dirty {
+    uint64_t summary;
+    uint64_t words[XSP_MAX_TX_QUEUE_NUM / 64];
+};
+
+// Version of the descriptor formats below, bumped whenever the layout of one
+// of them changes. See bind_dev_info.desc_version.
+#define XSP_DESC_VERSION 1
+
+// Descriptor formats of bind_dev_info.rx_desc_format and tx_desc_format.
+// Every descriptor starts with the opaque skb handle, the rings step through
+// them by xsp_ring.desc_size.
+// struct ring_entry: skb handle, source and destination mac. Kept for
+// compatibility, its 24 bytes straddle cache lines.
+#define XSP_DESC_FORMAT_BASIC 0
+// struct xsp_rx_desc_ext / struct xsp_tx_desc_ext, one cache line
+#define XSP_DESC_FORMAT_EXT 1
+// struct xsp_rx_desc_if, half a cache line, rx only
+#define XSP_DESC_FORMAT_IF 2
+// struct xsp_desc_compact, four per cache line
+#define XSP_DESC_FORMAT_COMPACT 3
+
+// Macs are in the low 6 bytes, in the byte order of the ethernet header
+struct ring_entry {
+    uint64_t addr;
+    uint64_t src_mac;
+    uint64_t dst_mac;
+};
+
+// Compact descriptor for forwarders that only pass handles around.
+struct xsp_desc_compact {
+    // Same as ring_entry.addr
+    uint64_t addr;
+    // rx: ingress device. tx: egress device, 0 sends out of the device of
+    // the tx ring, like xsp_tx_desc_ext.ifindex.
+    uint32_t ifindex;
+    // rx: flow hash, the one of the device if it set one. tx: must be 0.
+    uint32_t hash;
+};
+
+// Rx descriptor naming the ingress device, for rx rings shared by the
+// devices of a rx group. It starts with the fields of struct ring_entry.
+struct xsp_rx_desc_if {
+    // Same as struct ring_entry
+    uint64_t addr;
+    uint64_t src_mac;
+    uint64_t dst_mac;
+    uint32_t ifindex;
+    // Length of the packet including the ethernet header
+    uint32_t len;
+};
+
+// Bits of xsp_rx_desc_ext.flags
+// vlan_tci holds the outer vlan tag
+#define XSP_DESC_F_VLAN (1 << 0)
+// The packet is IPv4, saddr and daddr are valid
+#define XSP_DESC_F_IPV4 (1 << 1)
+// The packet is IPv6, addresses do not fit and are only covered by hash
+#define XSP_DESC_F_IPV6 (1 << 2)
+// sport and dport are valid
+#define XSP_DESC_F_PORTS (1 << 3)
+// hash covers the L4 ports
+#define XSP_DESC_F_L4_HASH (1 << 4)
+
+// Extended rx descriptor, one cache line. It starts with the fields of
+// struct ring_entry, so code only reading those works with either format
+// as long as it steps through the ring by the descriptor size. Multi-byte
+// packet fields (protocol, addresses, ports) are in network byte order.
+// With frame areas, the header window holds the first frame_len bytes of the
+// packet from the ethernet header on. Userspace may edit them in place until
+// it sends the packet, the window is then written back into the packet and
+// keeping checksums valid is up to userspace.
+struct xsp_rx_desc_ext {
+    // Same as struct ring_entry
+    uint64_t addr;
+    uint64_t src_mac;
+    uint64_t dst_mac;
+    // CLOCK_REALTIME ns when the rx handler saw the packet
+    uint64_t tstamp;
+    // Length of the packet including the ethernet header
+    uint32_t len;
+    // Flow hash, the one of the device if it set one
+    uint32_t hash;
+    // Ethertype of the L3 protocol, behind any vlan tags
+    uint16_t protocol;
+    // Host byte order, valid with XSP_DESC_F_VLAN
+    uint16_t vlan_tci;
+    // IPPROTO_* of the L4 protocol, 0 if unknown
+    uint8_t l4_proto;
+    // XSP_DESC_F_*
+    uint8_t flags;
+    // Bytes of the packet in its header window, 0 without a frame area
+    uint16_t frame_len;
+    uint32_t saddr;
+    uint32_t daddr;
+    uint16_t sport;
+    uint16_t dport;
+    // Offset of the header window in the frame area of the rx queue
+    uint32_t frame_off;
+} __attribute__((__aligned__(64)));
+
+// Bits of xsp_tx_desc_ext.actions, applied in this order before the packet
+// is transmitted.
+// Pop the outer vlan tag, if any
+#define XSP_TX_ACT_VLAN_POP (1 << 0)
+// Push vlan_tci with vlan_proto (ETH_P_8021Q if 0) as the outer tag
+#define XSP_TX_ACT_VLAN_PUSH (1 << 1)
+// Set the source / destination mac of the ethernet header
+#define XSP_TX_ACT_SET_SRC_MAC (1 << 2)
+#define XSP_TX_ACT_SET_DST_MAC (1 << 3)
+// Set skb->priority / skb->mark
+#define XSP_TX_ACT_SET_PRIORITY (1 << 4)
+#define XSP_TX_ACT_SET_MARK (1 << 5)
+// Send the packet out of every member of port group `group` instead of the
+// device of the tx ring, except the device it was received on
+#define XSP_TX_ACT_FANOUT (1 << 6)
+#define XSP_TX_ACT_ALL ((1 << 7) - 1)
+
+// Extended tx descriptor, one cache line. It starts with the fields of
+// struct ring_entry, the macs are only used by XSP_TX_ACT_SET_*_MAC.
+struct xsp_tx_desc_ext {
+    // Same as struct ring_entry
+    uint64_t addr;
+    uint64_t src_mac;
+    uint64_t dst_mac;
+    // XSP_TX_ACT_*
+    uint32_t actions;
+    uint32_t priority;
+    uint32_t mark;
+    // Host byte order
+    uint16_t vlan_tci;
+    uint16_t vlan_proto;
+    // Port group of XSP_TX_ACT_FANOUT
+    uint32_t group;
+    // Egress device, 0 sends out of the device of the tx ring. Any device
+    // bound through the same file may be named, so one tx ring can feed
+    // all of them; the counters of the tx ring count for every device it
+    // sends to.
+    uint32_t ifindex;
+    uint32_t reserved[4];
+} __attribute__((__aligned__(64)));
+
+// Values of xsp_tx_completion.status. Descriptors fanned out to a port
+// group complete once, when the packet is done on every member: SENT if it
+// went out of all of them, otherwise the status of the first member it did
+// not. Their busy copies are not handed back.
+// Handed to the device or its qdisc
+#define XSP_TX_STATUS_SENT 0
+// Dropped by the device or its qdisc, or the header window or the actions
+// of the descriptor could not be applied
+#define XSP_TX_STATUS_DROPPED 1
+// The handle is invalid, stale or already sent
+#define XSP_TX_STATUS_INVALID 2
+// The packet can not be forwarded to the device
+#define XSP_TX_STATUS_NOT_FORWARDABLE 3
+// The device was busy, the packet is handed back as new_handle and may be
+// sent again
+#define XSP_TX_STATUS_RETRY 4
+// The device was busy and the packet could not be handed back
+#define XSP_TX_STATUS_BUSY 5
+
+// Entry of a tx completion ring. Packets segmented by the kernel complete
+// once per segment, unless they were fanned out.
+struct xsp_tx_completion {
+    // Handle of the tx descriptor
+    uint64_t handle;
+    // XSP_TX_STATUS_RETRY: handle naming the packet again, 0 otherwise
+    uint64_t new_handle;
+    uint32_t status;
+    uint32_t reserved;
+};
+
+// The kernel and userspace both build the layouts above from this header.
+// Pin them, so that a change of either side that breaks the other does not
+// compile: the descriptor sizes are the ring strides reported at bind time,
+// and the kernel reads the handle of any format at offset 0.
+static_assert(sizeof(struct ring_entry) == 24, "ring_entry layout");
+static_assert(sizeof(struct xsp_desc_compact) == 16, "compact layout");
+static_assert(offsetof(struct xsp_desc_compact, ifindex) == 8,
+              "compact layout");
+static_assert(sizeof(struct xsp_rx_desc_if) == 32, "rx if layout");
+static_assert(offsetof(struct xsp_rx_desc_if, ifindex) == 24, "rx if layout");
+static_assert(sizeof(struct xsp_rx_desc_ext) == 64, "rx ext layout");
+static_assert(offsetof(struct xsp_rx_desc_ext, frame_off) == 60,
+              "rx ext layout");
+static_assert(sizeof(struct xsp_tx_desc_ext) == 64, "tx ext layout");
+static_assert(offsetof(struct xsp_tx_desc_ext, ifindex) == 44,
+              "tx ext layout");
+static_assert(sizeof(struct xsp_tx_completion) == 24, "completion layout");
+
+// Unbinds dev_name, which must be bound through the file of the ioctl, and
+// frees its queues. Its offsets may be handed out again by a later bind.
+// Skbs still named by handles of its rx queues are dropped. Fails with EBUSY
+// for the first device of a rx group that has other members. A bound device
+// going away, or whose file is closed, is unbound the same way, together
+// with the other members of its rx group.
+struct unbind_dev_info {
+    char dev_name[256];
+};
+
+// Packets received on in_dev with dst_mac are forwarded to out_dev by the
+// kernel without going through the rx ring. Both devices must be bound
+// through the file of the ioctl.
+struct flow_rule_info {
+    // Same encoding as ring_entry.dst_mac
+    uint64_t dst_mac;
+    char in_dev_name[256];
+    // Ignored by IOCTL_FLOW_DEL
+    char out_dev_name[256];
+};
+
+// Max queues of one IOCTL_SEND_BATCH
+#define XSP_SEND_BATCH_MAX 1024
+
+// Drains the tx queues at offsets[0..num) like one IOCTL_SEND each.
+struct send_batch_info {
+    uint64_t num;
+    // uint64_t[num], mmap offsets of the tx queues
+    uint64_t offsets;
+    // out: int32_t[num] or 0, descriptors read from each queue or a
+    // negative errno. Queues drained by a tx poller report 0.
+    uint64_t counts;
+};
+
+// Limits of IOCTL_PORT_GROUP_SET
+#define XSP_PORT_GROUP_MAX 4096
+#define XSP_PORT_GROUP_MAX_PORTS 256
+
+// Sets the members of port group id, used by XSP_TX_ACT_FANOUT. No members
+// removes the group. Members must be bound through the file of the ioctl,
+// each file has its own groups.
+struct port_group_info {
+    uint32_t id;
+    uint32_t num;
+    // uint32_t[num], ifindex of each member
+    uint64_t ifindexes;
+};
+
+// Signals the eventfd fd whenever the rx ring at mmap offset wakes up its
+// consumer, so that each thread can sleep on its own rings instead of on the
+// whole file. Several rings may share an eventfd. The thread sets
+// XSP_RING_NEED_WAKEUP on its rings, issues a full barrier and checks them
+// once more before it sleeps on the eventfd, the kernel clears the flag of a
+// ring when it signals. A ring keeps its eventfd until it is unbound.
+struct rx_eventfd_info {
+    uint64_t offset;
+    int32_t fd;
+    uint32_t pad;
+};
+
+// States of a queue slot
+// No queue exists, e.g. the cpu of a rx queue slot was never online.
+#define XSP_QUEUE_ABSENT 0
+#define XSP_QUEUE_ONLINE 1
+// The cpu of a rx queue went offline, no new packets will show up in the
+// queue but it stays mapped. It is online again when the cpu comes back.
+#define XSP_QUEUE_RETIRED 2
+
+// Set in xsp_queue_stats.cpu of queues not tied to a cpu.
+#define XSP_QUEUE_NO_CPU 0xffffffff
+
+// Counters of one queue. Each queue has a single writer (the cpu owning a rx
+// queue, the sender draining a tx queue), so they are plain counters, one
+// cache line per queue.
+struct xsp_queue_stats {
+    // Layout of the queue slot, see XSP_QUEUE_*
+    uint32_t state;
+    uint32_t cpu;
+    // NUMA node of the memory of the queue: the node of its cpu for per cpu
+    // rx queues, the node of the device for the others. Threads polling the
+    // queue run best on this node.
+    uint32_t node;
+    uint32_t pad;
+    // rx: packets/bytes enqueued to the ring, tx: packets/bytes transmitted
+    uint64_t packets;
+    uint64_t bytes;
+    // rx: producer index publications, tx: send calls that found work.
+    // packets / batches is the average batch size.
+    uint64_t batches;
+    // rx: packets dropped because the ring was full
+    uint64_t ring_full_drops;
+    // tx: packets dropped because the device was busy
+    uint64_t tx_busy;
+    // tx: packets dropped because they can not be forwarded to the device
+    uint64_t tx_not_forwardable;
+    // tx: packets dropped by the device or its qdisc
+    uint64_t tx_dropped;
+    // tx: descriptors whose handle is invalid, stale or already sent
+    uint64_t invalid_descs;
+    // rx: packets forwarded by the flow table, their transmit errors are
+    // counted in the tx_* counters of the rx queue.
+    uint64_t offloaded;
+    // rx: packets dropped because all skb handles of the queue are in use
+    uint64_t handle_drops;
+    // tx: packets of a busy device handed back on the completion ring
+    uint64_t tx_retries;
+    // tx: completions lost because the completion ring was full
+    uint64_t completion_drops;
+} __attribute__((__aligned__(64)));
+
+// Region mapped read-only at bind_dev_info.stats_offset, and writable at
+// offset 0 of the binding region, see xsp_region_layout. Counters of the rx
+// queues come first, followed by the ones of the tx queues.
+struct xsp_stats_region {
+    uint64_t rx_queue_num;
+    uint64_t tx_queue_num;
+    // Bumped after the state of any queue slot changed (cpu hotplug), the
+    // queues that came online can then be mapped.
+    uint64_t layout_gen;
+    struct xsp_queue_stats queues[] __attribute__((__aligned__(64)));
 };
 
 #endif
@@ -0,0 +1,156 @@
+#ifndef _XSP_FLOW_TABLE_H
+#define _XSP_FLOW_TABLE_H
+
+#include <linux/hash.h>
+#include <linux/kernel.h>
+#include <linux/netdevice.h>
+#include <linux/rculist.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+/// # NOTE
+/// Flow table maps (dst mac, ingress dev) to an egress dev, so that the rx
+/// handler can forward packets of known flows without going through
+/// userspace. Lookups are lock-free under rcu, updates are serialized by the
+/// table spinlock. Entries do not hold a reference to the devices, the owner
+/// must remove every entry of a device before releasing it.
+
+#define FLOW_TABLE_BITS 12
+#define FLOW_TABLE_SIZE (1 << FLOW_TABLE_BITS)
+
+struct flow_entry {
+  // Same encoding as ring_entry.dst_mac
+  u64 dst_mac;
+  struct net_device *in_dev;
+  struct net_device *out_dev;
+  struct hlist_node hlist_node;
+  struct rcu_head rcu;
+};
+
+struct flow_table {
+  struct hlist_head buckets[FLOW_TABLE_SIZE];
+  atomic_t size;
+  spinlock_t lock;
+};
+
+void flow_table_init(struct flow_table *table);
+int flow_table_insert(struct flow_table *table, u64 dst_mac,
+                      struct net_device *in_dev, struct net_device *out_dev);
+struct net_device *flow_table_lookup(struct flow_table *table, u64 dst_mac,
+                                     struct net_device *in_dev);
+int flow_table_remove(struct flow_table *table, u64 dst_mac,
+                      struct net_device *in_dev);
+void flow_table_remove_dev(struct flow_table *table, struct net_device *dev);
+void flow_table_clear(struct flow_table *table);
+
+static inline u32 flow_hash(u64 dst_mac, struct net_device *in_dev) {
+  return hash_64(dst_mac ^ (u64)(unsigned long)in_dev, FLOW_TABLE_BITS);
+}
+
+void flow_table_init(struct flow_table *table) {
+  for (int i = 0; i < FLOW_TABLE_SIZE; i++) {
+    INIT_HLIST_HEAD(&table->buckets[i]);
+  }
+  atomic_set(&table->size, 0);
+  spin_lock_init(&table->lock);
+}
+
+// Insert a flow, the egress dev of an existing flow is replaced.
+int flow_table_insert(struct flow_table *table, u64 dst_mac,
+                      struct net_device *in_dev, struct net_device *out_dev) {
+  struct hlist_head *bucket = &table->buckets[flow_hash(dst_mac, in_dev)];
+  struct flow_entry *entry = NULL;
+  struct flow_entry *new_entry = kzalloc(sizeof(*new_entry), GFP_KERNEL);
+  if (!new_entry) {
+    return -ENOMEM;
+  }
+  new_entry->dst_mac = dst_mac;
+  new_entry->in_dev = in_dev;
+  new_entry->out_dev = out_dev;
+
+  spin_lock(&table->lock);
+  hlist_for_each_entry(entry, bucket, hlist_node) {
+    if (entry->dst_mac == dst_mac && entry->in_dev == in_dev) {
+      hlist_replace_rcu(&entry->hlist_node, &new_entry->hlist_node);
+      spin_unlock(&table->lock);
+      kfree_rcu(entry, rcu);
+      return 0;
+    }
+  }
+  hlist_add_head_rcu(&new_entry->hlist_node, bucket);
+  atomic_inc(&table->size);
+  spin_unlock(&table->lock);
+  return 0;
+}
+
+// Must be called under rcu_read_lock(), the returned dev is only valid
+// within the read side critical section.
+struct net_device *flow_table_lookup(struct flow_table *table, u64 dst_mac,
+                                     struct net_device *in_dev) {
+  struct flow_entry *entry = NULL;
+
+  if (!atomic_read(&table->size)) {
+    return NULL;
+  }
+  hlist_for_each_entry_rcu(
+      entry, &table->buckets[flow_hash(dst_mac, in_dev)], hlist_node) {
+    if (entry->dst_mac == dst_mac && entry->in_dev == in_dev) {
+      return READ_ONCE(entry->out_dev);
+    }
+  }
+  return NULL;
+}
+
+int flow_table_remove(struct flow_table *table, u64 dst_mac,
+                      struct net_device *in_dev) {
+  struct flow_entry *entry = NULL;
+
+  spin_lock(&table->lock);
+  hlist_for_each_entry(
+      entry, &table->buckets[flow_hash(dst_mac, in_dev)], hlist_node) {
+    if (entry->dst_mac == dst_mac && entry->in_dev == in_dev) {
+      hlist_del_rcu(&entry->hlist_node);
+      atomic_dec(&table->size);
+      spin_unlock(&table->lock);
+      kfree_rcu(entry, rcu);
+      return 0;
+    }
+  }
+  spin_unlock(&table->lock);
+  return -ENOENT;
+}
+
+// Remove every flow that enters or leaves through dev.
+void flow_table_remove_dev(struct flow_table *table, struct net_device *dev) {
+  struct flow_entry *entry = NULL;
+  struct hlist_node *tmp;
+
+  spin_lock(&table->lock);
+  for (int i = 0; i < FLOW_TABLE_SIZE; i++) {
+    hlist_for_each_entry_safe(entry, tmp, &table->buckets[i], hlist_node) {
+      if (entry->in_dev == dev || entry->out_dev == dev) {
+        hlist_del_rcu(&entry->hlist_node);
+        atomic_dec(&table->size);
+        kfree_rcu(entry, rcu);
+      }
+    }
+  }
+  spin_unlock(&table->lock);
+}
+
+void flow_table_clear(struct flow_table *table) {
+  struct flow_entry *entry = NULL;
+  struct hlist_node *tmp;
+
+  spin_lock(&table->lock);
+  for (int i = 0; i < FLOW_TABLE_SIZE; i++) {
+    hlist_for_each_entry_safe(entry, tmp, &table->buckets[i], hlist_node) {
+      hlist_del_rcu(&entry->hlist_node);
+      kfree_rcu(entry, rcu);
+    }
+  }
+  atomic_set(&table->size, 0);
+  spin_unlock(&table->lock);
+}
+
+#endif
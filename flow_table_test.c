@@ -0,0 +1,89 @@
+#include "flow_table.h"
+#include <linux/module.h>
+
+static struct flow_table flow_table;
+
+static void test_flow_table(void) {
+  struct net_device *in_dev = (struct net_device *)0x12345678;
+  struct net_device *other_in_dev = (struct net_device *)0x12345679;
+  struct net_device *out_dev = (struct net_device *)0x87654321;
+  struct net_device *new_out_dev = (struct net_device *)0x87654322;
+  struct net_device *found = NULL;
+  u64 dst_mac = 0x0000aabbccddeeff;
+
+  flow_table_init(&flow_table);
+
+  // Insert and lookup
+  flow_table_insert(&flow_table, dst_mac, in_dev, out_dev);
+  rcu_read_lock();
+  found = flow_table_lookup(&flow_table, dst_mac, in_dev);
+  rcu_read_unlock();
+  if (found == out_dev) {
+    pr_info("Flow found in flow_table with correct egress dev\n");
+  } else {
+    pr_err("Flow not found in flow_table\n");
+  }
+
+  // Same mac from another ingress dev is another flow
+  rcu_read_lock();
+  found = flow_table_lookup(&flow_table, dst_mac, other_in_dev);
+  rcu_read_unlock();
+  if (!found) {
+    pr_info("Flow of other ingress dev correctly not found\n");
+  } else {
+    pr_err("Flow of other ingress dev incorrectly found\n");
+  }
+
+  // Insert again replaces the egress dev
+  flow_table_insert(&flow_table, dst_mac, in_dev, new_out_dev);
+  rcu_read_lock();
+  found = flow_table_lookup(&flow_table, dst_mac, in_dev);
+  rcu_read_unlock();
+  if (found == new_out_dev && atomic_read(&flow_table.size) == 1) {
+    pr_info("Flow replaced in flow_table\n");
+  } else {
+    pr_err("Flow not replaced in flow_table\n");
+  }
+
+  // Remove
+  if (flow_table_remove(&flow_table, dst_mac, in_dev) != 0) {
+    pr_err("Failed to remove flow\n");
+  }
+  rcu_read_lock();
+  found = flow_table_lookup(&flow_table, dst_mac, in_dev);
+  rcu_read_unlock();
+  if (!found) {
+    pr_info("Removed flow correctly not found\n");
+  } else {
+    pr_err("Removed flow incorrectly found\n");
+  }
+
+  // Remove all flows of a dev
+  flow_table_insert(&flow_table, dst_mac, in_dev, out_dev);
+  flow_table_insert(&flow_table, dst_mac + 1, other_in_dev, out_dev);
+  flow_table_remove_dev(&flow_table, out_dev);
+  if (atomic_read(&flow_table.size) == 0) {
+    pr_info("Flows of removed dev correctly removed\n");
+  } else {
+    pr_err("Flows of removed dev still in flow_table\n");
+  }
+
+  flow_table_clear(&flow_table);
+  rcu_barrier();
+}
+
+static int __init flow_table_test_init(void) {
+  test_flow_table();
+
+  return 0;
+}
+
+static void __exit flow_table_test_exit(void) {}
+
+module_init(flow_table_test_init);
+module_exit(flow_table_test_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("ZENOTME");
+MODULE_DESCRIPTION("Test module for flow_table");
+MODULE_VERSION("1.0");
@@ -1,4 +1,5 @@
 #include "xsp_queue.h"
+#include <linux/bitmap.h>
 #include <linux/cdev.h>
 #include <linux/etherdevice.h>
 #include <linux/fs.h>
@@ -14,207 +15,392 @@
 #include <linux/spinlock.h>
 #include <linux/uaccess.h>
 #include <linux/veth.h>
+#include <linux/xarray.h>
 
 /// # NOTE
 /// All operation of map is thread safe guarded by rcu and spinlock.
 
-#define DEV_QUEUE_TABLE_SIZE 1 << 10
-#define OFFSET_QUEUE_TABLE_SIZE 1 << 10
+struct tx_poller;
+struct xsp_ctx;
 
 struct dev_queue_entry {
   struct net_device *dev;
+  // Context of the file the device was bound through
+  struct xsp_ctx *ctx;
   struct queue_array *tx_queue_array;
   struct queue_array *rx_queue_array;
-  struct hlist_node hlist_node;
+  // Counters of all queues of the device, mapped read-only by userspace.
+  struct xsp_stats_region *stats;
+  size_t stats_size;
+  // Mmap offset of the first rx queue slot
+  loff_t rx_start_offset;
+  // Geometry of each rx ring, rx queues of cpus coming online get the same
+  u32 rx_ring_depth;
+  // Stride of the rx rings, see XSP_DESC_FORMAT_*
+  u32 rx_desc_size;
+  // Header window of each packet, 0 without frame areas
+  u32 rx_frame_size;
+  // Mmap offset of the frame area of the first rx queue slot
+  loff_t rx_frame_start_offset;
+  // First device of the rx group whose rx queues this device shares, NULL
+  // if it owns its rx queues
+  struct dev_queue_entry *rx_owner;
+  // Kernel thread draining the tx queues, NULL if userspace sends them
+  struct tx_poller *tx_poller;
+  // Tx dirty region of devices bound with XSP_BIND_TX_DIRTY, NULL otherwise
+  struct xsp_tx_dirty *tx_dirty;
+  // Completion rings of devices bound with XSP_BIND_TX_COMPLETION, NULL
+  // otherwise
+  struct queue_array *tx_comp_array;
+  // Rx group of the device, 0 if none
+  u32 rx_group;
+  // Where the parts of the device are in its region, see
+  // bind_dev_info.region_offset
+  struct xsp_region_layout region;
+  // Mmap offsets of the device, given back when it is unbound
+  loff_t offset_start;
+  size_t offset_num;
+  // In dev_queue_table.entries
+  struct list_head list_node;
+  // In xsp_ctx.devs once the device is fully bound
+  struct list_head ctx_node;
   struct rcu_head rcu;
 };
 
+// Bound devices by ifindex. Lookups are lock-free under rcu, an entry is
+// only valid within the read side critical section of its lookup unless
+// the caller excludes unbinding.
 struct dev_queue_table {
-  struct hlist_head buckets[DEV_QUEUE_TABLE_SIZE];
+  struct xarray devs;
+  // All entries, walked by the callers that visit every bound device
+  struct list_head entries;
   spinlock_t lock;
 };
 
 void dev_queue_table_init(struct dev_queue_table *table);
-void dev_queue_table_insert(struct dev_queue_table *table,
-                            struct net_device *dev,
-                            struct queue_array *tx_queue_array,
-                            struct queue_array *rx_queue_array);
+struct dev_queue_entry *
+dev_queue_table_insert(struct dev_queue_table *table, struct net_device *dev,
+                       struct queue_array *tx_queue_array,
+                       struct queue_array *rx_queue_array);
 struct dev_queue_entry *dev_queue_table_lookup(struct dev_queue_table *table,
                                                struct net_device *dev);
+struct dev_queue_entry *
+dev_queue_table_lookup_index(struct dev_queue_table *table, int ifindex);
 void dev_queue_table_remove(struct dev_queue_table *table,
                             struct net_device *dev);
 void dev_queue_table_clear(struct dev_queue_table *table);
 
-static inline int hash_func(void *key) {
-  return (int)(((unsigned long)key) % DEV_QUEUE_TABLE_SIZE);
-}
-
 void dev_queue_table_init(struct dev_queue_table *table) {
-  int i;
-  for (i = 0; i < DEV_QUEUE_TABLE_SIZE; i++) {
-    INIT_HLIST_HEAD(&table->buckets[i]);
-  }
+  xa_init(&table->devs);
+  INIT_LIST_HEAD(&table->entries);
   spin_lock_init(&table->lock);
 }
 
-void dev_queue_table_insert(struct dev_queue_table *table,
-                            struct net_device *dev,
-                            struct queue_array *tx_queue_array,
-                            struct queue_array *rx_queue_array) {
-  int hash = hash_func(dev);
+struct dev_queue_entry *
+dev_queue_table_insert(struct dev_queue_table *table, struct net_device *dev,
+                       struct queue_array *tx_queue_array,
+                       struct queue_array *rx_queue_array) {
   struct dev_queue_entry *new_entry =
-      kmalloc(sizeof(struct dev_queue_entry), GFP_KERNEL);
+      kzalloc(sizeof(struct dev_queue_entry), GFP_KERNEL);
+  if (!new_entry) {
+    return NULL;
+  }
   new_entry->dev = dev;
   new_entry->tx_queue_array = tx_queue_array;
   new_entry->rx_queue_array = rx_queue_array;
 
+  if (xa_insert(&table->devs, dev->ifindex, new_entry, GFP_KERNEL)) {
+    kfree(new_entry);
+    return NULL;
+  }
   spin_lock(&table->lock);
-  hlist_add_head_rcu(&new_entry->hlist_node, &table->buckets[hash]);
+  list_add_tail_rcu(&new_entry->list_node, &table->entries);
   spin_unlock(&table->lock);
+  return new_entry;
+}
+
+struct dev_queue_entry *
+dev_queue_table_lookup_index(struct dev_queue_table *table, int ifindex) {
+  return xa_load(&table->devs, ifindex);
 }
 
 struct dev_queue_entry *dev_queue_table_lookup(struct dev_queue_table *table,
                                                struct net_device *dev) {
-  struct dev_queue_entry *entry = NULL;
-  int hash = hash_func(dev);
-
-  rcu_read_lock();
-  hlist_for_each_entry_rcu(entry, &table->buckets[hash], hlist_node) {
-    if (entry->dev == dev) {
-      break;
-    }
-  }
-  rcu_read_unlock();
+  struct dev_queue_entry *entry =
+      dev_queue_table_lookup_index(table, dev->ifindex);
 
-  return entry;
+  return entry && entry->dev == dev ? entry : NULL;
 }
 
 void dev_queue_table_remove(struct dev_queue_table *table,
                             struct net_device *dev) {
-  struct dev_queue_entry *entry;
-  int hash = hash_func(dev);
+  struct dev_queue_entry *entry = dev_queue_table_lookup(table, dev);
 
-  spin_lock(&table->lock);
-  hlist_for_each_entry_rcu(entry, &table->buckets[hash], hlist_node) {
-    if (entry->dev == dev) {
-      hlist_del_rcu(&entry->hlist_node);
-      kfree_rcu(entry, rcu);
-      break;
-    }
+  if (!entry) {
+    return;
   }
+  xa_erase(&table->devs, dev->ifindex);
+  spin_lock(&table->lock);
+  list_del_rcu(&entry->list_node);
   spin_unlock(&table->lock);
+  kfree_rcu(entry, rcu);
 }
 
 void dev_queue_table_clear(struct dev_queue_table *table) {
   struct dev_queue_entry *entry;
-  int i;
+  struct dev_queue_entry *tmp;
 
   spin_lock(&table->lock);
-  for (i = 0; i < DEV_QUEUE_TABLE_SIZE; i++) {
-    hlist_for_each_entry_rcu(entry, &table->buckets[i], hlist_node) {
-      hlist_del_rcu(&entry->hlist_node);
-      kfree_rcu(entry, rcu);
-    }
+  list_for_each_entry_safe(entry, tmp, &table->entries, list_node) {
+    list_del_rcu(&entry->list_node);
+    kfree_rcu(entry, rcu);
   }
   spin_unlock(&table->lock);
+  xa_destroy(&table->devs);
 }
 
 struct offset_queue_entry {
   struct net_device *dev;
   struct xsp_queue *queue;
+  // vmalloc() region mapped at this offset when queue is NULL, read-only
+  // unless region_writable is set.
+  void *region;
+  size_t region_size;
+  bool region_writable;
+  // Set if queue is a tx ring, the only queues userspace may send
+  bool tx;
+  // Set at the offset of the whole region of the bound device dev, which
+  // has neither queue nor region of its own
+  bool binding;
+  struct rcu_head rcu;
 };
 
+// Mmap offsets by page index. Lookups are lock-free under rcu and take O(1),
+// the xarray grows with the bound devices, so binding does not disturb
+// concurrent senders. Entries are freed after a grace period once removed.
+// Ranges of indexes are handed out by offset_queue_fetch_next() and reused
+// once released.
 struct offset_queue_table {
-  atomic64_t next_index;
-  u64 queue_capacity;
-  u64 queue_num;
-  struct offset_queue_entry *queue_array;
-  spinlock_t lock;
+  struct xarray entries;
+  // A bit per page index in use
+  unsigned long *used;
+  unsigned long used_bits;
+  struct mutex lock;
 };
 
 int offset_queue_table_init(struct offset_queue_table *table);
-loff_t offset_queue_next_offset(struct offset_queue_table *table);
+loff_t offset_queue_fetch_next(struct offset_queue_table *table,
+                               size_t queue_num);
+void offset_queue_release(struct offset_queue_table *table, loff_t offset,
+                          size_t queue_num);
 int offset_queue_table_insert(struct offset_queue_table *table, loff_t offset,
                               struct net_device *dev, struct xsp_queue *queue);
+int offset_queue_table_insert_tx(struct offset_queue_table *table,
+                                 loff_t offset, struct net_device *dev,
+                                 struct xsp_queue *queue);
+int offset_queue_table_insert_region(struct offset_queue_table *table,
+                                     loff_t offset, struct net_device *dev,
+                                     void *region, size_t region_size,
+                                     bool writable);
+int offset_queue_table_insert_binding(struct offset_queue_table *table,
+                                      loff_t offset, struct net_device *dev);
 struct offset_queue_entry *
 offset_queue_table_lookup(struct offset_queue_table *table, loff_t offset);
+int offset_queue_table_set_queue(struct offset_queue_table *table,
+                                 loff_t offset, struct xsp_queue *queue);
+int offset_queue_table_set_region(struct offset_queue_table *table,
+                                  loff_t offset, void *region,
+                                  size_t region_size);
+void offset_queue_table_remove(struct offset_queue_table *table,
+                               loff_t offset);
 void offset_queue_table_clear(struct offset_queue_table *table);
 
-static inline loff_t offset_queue_fetch_next(struct offset_queue_table *table,
-                                             size_t queue_num) {
-  // The index is shifted left by PAGE_SHIFT because it will be used as the mmap
-  // offset parameter which needs to be in page units.
-  return atomic64_fetch_add(queue_num, &table->next_index) << PAGE_SHIFT;
-}
-
 static inline u64 offset_to_index(loff_t offset) {
   return offset >> PAGE_SHIFT;
 }
 
+#define OFFSET_QUEUE_INIT_BITS 4096
+
 int offset_queue_table_init(struct offset_queue_table *table) {
-  table->queue_capacity = 4096;
-  table->queue_num = 0;
-  table->queue_array = kmalloc_array(table->queue_capacity,
-                                     sizeof(struct xsp_queue *), GFP_KERNEL);
-  if (!table->queue_array) {
-    printk(KERN_ERR "Failed to allocate memory for offset queue array\n");
+  table->used = bitmap_zalloc(OFFSET_QUEUE_INIT_BITS, GFP_KERNEL);
+  if (!table->used) {
+    printk(KERN_ERR "Failed to allocate memory for offset queue bitmap\n");
     return -1;
   }
-  atomic64_set(&table->next_index, 0);
-  spin_lock_init(&table->lock);
+  table->used_bits = OFFSET_QUEUE_INIT_BITS;
+  xa_init(&table->entries);
+  mutex_init(&table->lock);
   return 0;
 }
 
-int offset_queue_table_insert(struct offset_queue_table *table, loff_t offset,
-                              struct net_device *dev, struct xsp_queue *queue) {
-  BUG_ON(table->queue_array == NULL);
-  BUG_ON(table->queue_num > table->queue_capacity);
+// Make room for at least bits indexes, with table->lock held.
+static int offset_queue_table_grow(struct offset_queue_table *table,
+                                   unsigned long bits) {
+  unsigned long new_bits = max(table->used_bits * 2, bits);
+  unsigned long *used = bitmap_zalloc(new_bits, GFP_KERNEL);
 
-  // If the queue array is full, we need to expand it.
-  spin_lock(&table->lock);
-  if (unlikely(table->queue_num == table->queue_capacity)) {
-    struct offset_queue_entry *new_array =
-        kmalloc_array(table->queue_capacity * 2,
-                      sizeof(struct offset_queue_entry), GFP_KERNEL);
-    if (!new_array) {
-      printk(KERN_ERR
-             "Failed to allocate memory for offset queue array expansion\n");
-      return -1;
+  if (!used) {
+    return -ENOMEM;
+  }
+  bitmap_copy(used, table->used, table->used_bits);
+  bitmap_free(table->used);
+  table->used = used;
+  table->used_bits = new_bits;
+  return 0;
+}
+
+// Reserve queue_num consecutive offsets, returns the first one or -ENOMEM.
+loff_t offset_queue_fetch_next(struct offset_queue_table *table,
+                               size_t queue_num) {
+  unsigned long index;
+
+  mutex_lock(&table->lock);
+  for (;;) {
+    index = bitmap_find_next_zero_area(table->used, table->used_bits, 0,
+                                       queue_num, 0);
+    if (index + queue_num <= table->used_bits) {
+      break;
     }
-    for (int i = 0; i < table->queue_capacity; i++) {
-      new_array[i].queue = table->queue_array[i].queue;
-      new_array[i].dev = table->queue_array[i].dev;
+    if (offset_queue_table_grow(table, table->used_bits + queue_num)) {
+      mutex_unlock(&table->lock);
+      return -ENOMEM;
     }
-    kfree(table->queue_array);
-    table->queue_array = new_array;
-    table->queue_capacity *= 2;
   }
+  bitmap_set(table->used, index, queue_num);
+  mutex_unlock(&table->lock);
+  // The index is shifted left by PAGE_SHIFT because it will be used as the mmap
+  // offset parameter which needs to be in page units.
+  return (loff_t)index << PAGE_SHIFT;
+}
+
+// Remove the entries of queue_num offsets from offset on and make the
+// offsets available again.
+void offset_queue_release(struct offset_queue_table *table, loff_t offset,
+                          size_t queue_num) {
+  u64 index = offset_to_index(offset);
+
+  for (size_t i = 0; i < queue_num; i++) {
+    offset_queue_table_remove(table, offset + i * PAGE_SIZE);
+  }
+  mutex_lock(&table->lock);
+  bitmap_clear(table->used, index, queue_num);
+  mutex_unlock(&table->lock);
+}
 
-  u64 idx = table->queue_num++;
-  table->queue_array[idx].queue = queue;
-  table->queue_array[idx].dev = dev;
-  spin_unlock(&table->lock);
-  return 0;
+static int offset_queue_table_store(struct offset_queue_table *table,
+                                    loff_t offset,
+                                    struct offset_queue_entry *entry) {
+  struct offset_queue_entry *new_entry = kmemdup(entry, sizeof(*entry),
+                                                 GFP_KERNEL);
+  int ret;
+
+  if (!new_entry) {
+    return -ENOMEM;
+  }
+  // Offsets are handed out once by offset_queue_fetch_next()
+  ret = xa_insert(&table->entries, offset_to_index(offset), new_entry,
+                  GFP_KERNEL);
+  if (ret) {
+    kfree(new_entry);
+  }
+  return ret;
+}
+
+int offset_queue_table_insert(struct offset_queue_table *table, loff_t offset,
+                              struct net_device *dev, struct xsp_queue *queue) {
+  struct offset_queue_entry entry = {.dev = dev, .queue = queue};
+
+  return offset_queue_table_store(table, offset, &entry);
 }
 
+// Like offset_queue_table_insert() for a tx ring, which can be sent
+int offset_queue_table_insert_tx(struct offset_queue_table *table,
+                                 loff_t offset, struct net_device *dev,
+                                 struct xsp_queue *queue) {
+  struct offset_queue_entry entry = {.dev = dev, .queue = queue, .tx = true};
+
+  return offset_queue_table_store(table, offset, &entry);
+}
+
+int offset_queue_table_insert_region(struct offset_queue_table *table,
+                                     loff_t offset, struct net_device *dev,
+                                     void *region, size_t region_size,
+                                     bool writable) {
+  struct offset_queue_entry entry = {.dev = dev,
+                                     .region = region,
+                                     .region_size = region_size,
+                                     .region_writable = writable};
+
+  return offset_queue_table_store(table, offset, &entry);
+}
+
+int offset_queue_table_insert_binding(struct offset_queue_table *table,
+                                      loff_t offset, struct net_device *dev) {
+  struct offset_queue_entry entry = {.dev = dev, .binding = true};
+
+  return offset_queue_table_store(table, offset, &entry);
+}
+
+// The returned entry stays valid until it is removed, callers that may race
+// with offset_queue_table_remove() must hold rcu_read_lock().
 struct offset_queue_entry *
 offset_queue_table_lookup(struct offset_queue_table *table, loff_t offset) {
-  BUG_ON(table->queue_array == NULL);
-  u64 index = offset_to_index(offset);
-  if (index >= table->queue_num) {
-    return NULL;
+  return xa_load(&table->entries, offset_to_index(offset));
+}
+
+// Set the queue of an offset inserted without one.
+int offset_queue_table_set_queue(struct offset_queue_table *table,
+                                 loff_t offset, struct xsp_queue *queue) {
+  struct offset_queue_entry *entry = NULL;
+
+  xa_lock(&table->entries);
+  entry = xa_load(&table->entries, offset_to_index(offset));
+  if (entry) {
+    WRITE_ONCE(entry->queue, queue);
   }
+  xa_unlock(&table->entries);
+  return entry ? 0 : -EINVAL;
+}
 
-  return &table->queue_array[index];
+// Set the region of an offset inserted without one.
+int offset_queue_table_set_region(struct offset_queue_table *table,
+                                  loff_t offset, void *region,
+                                  size_t region_size) {
+  struct offset_queue_entry *entry = NULL;
+
+  xa_lock(&table->entries);
+  entry = xa_load(&table->entries, offset_to_index(offset));
+  if (entry) {
+    entry->region_size = region_size;
+    // Pairs with the smp_load_acquire() in xspdev_mmap()
+    smp_store_release(&entry->region, region);
+  }
+  xa_unlock(&table->entries);
+  return entry ? 0 : -EINVAL;
+}
+
+void offset_queue_table_remove(struct offset_queue_table *table,
+                               loff_t offset) {
+  struct offset_queue_entry *entry =
+      xa_erase(&table->entries, offset_to_index(offset));
+
+  if (entry) {
+    kfree_rcu(entry, rcu);
+  }
 }
 
 void offset_queue_table_clear(struct offset_queue_table *table) {
-  if (table->queue_array) {
-    kfree(table->queue_array);
-    table->queue_array = NULL;
+  struct offset_queue_entry *entry = NULL;
+  unsigned long index;
+
+  xa_for_each(&table->entries, index, entry) {
+    xa_erase(&table->entries, index);
+    kfree_rcu(entry, rcu);
   }
-  table->queue_num = 0;
-  table->queue_capacity = 0;
+  xa_destroy(&table->entries);
+  bitmap_free(table->used);
+  table->used = NULL;
+  table->used_bits = 0;
 }
 
 struct ptr_vector {
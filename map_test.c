@@ -5,12 +5,20 @@ static struct dev_queue_table dev_table;
 static struct offset_queue_table offset_table;
 
 static void test_dev_queue_table(void) {
-  struct net_device *mock_dev = (struct net_device *)0x12345678;
-  struct net_device *nonexistent_dev = (struct net_device *)0x12345679;
+  // The table is keyed by ifindex, the devices must be readable
+  struct net_device *mock_dev = kzalloc(sizeof(*mock_dev), GFP_KERNEL);
+  struct net_device *nonexistent_dev = kzalloc(sizeof(*mock_dev), GFP_KERNEL);
   struct queue_array *mock_rx_queue = (struct queue_array *)0x87654321;
   struct queue_array *mock_tx_queue = (struct queue_array *)0x87654322;
   struct dev_queue_entry *dev_entry;
 
+  if (!mock_dev || !nonexistent_dev) {
+    pr_err("Failed to allocate mock devices\n");
+    goto out;
+  }
+  mock_dev->ifindex = 7;
+  nonexistent_dev->ifindex = 8;
+
   // 初始化表
   dev_queue_table_init(&dev_table);
 
@@ -36,8 +44,36 @@ static void test_dev_queue_table(void) {
     pr_err("Nonexistent device incorrectly found in dev_queue_table\n");
   }
 
+  // Lookup by ifindex
+  dev_entry = dev_queue_table_lookup_index(&dev_table, mock_dev->ifindex);
+  if (dev_entry && dev_entry->dev == mock_dev) {
+    pr_info("Device found by ifindex in dev_queue_table\n");
+  } else {
+    pr_err("Device not found by ifindex in dev_queue_table\n");
+  }
+
+  // The same ifindex can not be bound twice
+  if (!dev_queue_table_insert(&dev_table, mock_dev, mock_rx_queue,
+                              mock_tx_queue)) {
+    pr_info("Duplicate ifindex correctly rejected\n");
+  } else {
+    pr_err("Duplicate ifindex incorrectly accepted\n");
+  }
+
   // 从表中移除
   dev_queue_table_remove(&dev_table, mock_dev);
+  if (!dev_queue_table_lookup(&dev_table, mock_dev) &&
+      list_empty(&dev_table.entries)) {
+    pr_info("Device correctly removed from dev_queue_table\n");
+  } else {
+    pr_err("Device still in dev_queue_table\n");
+  }
+  dev_queue_table_clear(&dev_table);
+  rcu_barrier();
+
+out:
+  kfree(mock_dev);
+  kfree(nonexistent_dev);
 }
 
 static void test_offset_queue_table(void) {
@@ -54,7 +90,7 @@ static void test_offset_queue_table(void) {
   offset_queue_table_insert(&offset_table, mock_offset, mock_netdev,
                             mock_offset_queue);
   q = offset_queue_table_lookup(&offset_table, mock_offset);
-  if (q) {
+  if (q && !q->tx) {
     pr_info("Offset found in offset_queue_table\n");
   } else {
     pr_err("Offset not found in offset_queue_table\n");
@@ -68,7 +104,71 @@ static void test_offset_queue_table(void) {
     pr_err("Nonexistent offset incorrectly found in offset_queue_table\n");
   }
 
+  // Only tx rings can be sent
+  offset_queue_table_insert_tx(&offset_table, 2 << PAGE_SHIFT, mock_netdev,
+                               mock_offset_queue);
+  q = offset_queue_table_lookup(&offset_table, 2 << PAGE_SHIFT);
+  if (q && q->tx && q->queue == mock_offset_queue) {
+    pr_info("Tx offset found in offset_queue_table\n");
+  } else {
+    pr_err("Tx offset not found in offset_queue_table\n");
+  }
+
+  // The offset of a binding region has neither queue nor region
+  offset_queue_table_insert_binding(&offset_table, 1 << PAGE_SHIFT,
+                                    mock_netdev);
+  q = offset_queue_table_lookup(&offset_table, 1 << PAGE_SHIFT);
+  if (q && q->binding && q->dev == mock_netdev && !q->queue && !q->region) {
+    pr_info("Binding offset found in offset_queue_table\n");
+  } else {
+    pr_err("Binding offset not found in offset_queue_table\n");
+  }
+
+  // Offsets past any initial capacity
+  for (int i = 16; i < 8192; i++) {
+    offset_queue_table_insert(&offset_table, (loff_t)i << PAGE_SHIFT,
+                              mock_netdev, NULL);
+  }
+  loff_t last_offset = (loff_t)(8192 - 1) << PAGE_SHIFT;
+  offset_queue_table_set_queue(&offset_table, last_offset, mock_offset_queue);
+  q = offset_queue_table_lookup(&offset_table, last_offset);
+  if (q && q->queue == mock_offset_queue) {
+    pr_info("Grown offset found in offset_queue_table with its queue\n");
+  } else {
+    pr_err("Grown offset not found in offset_queue_table\n");
+  }
+
+  offset_queue_table_remove(&offset_table, last_offset);
+  if (!offset_queue_table_lookup(&offset_table, last_offset)) {
+    pr_info("Removed offset correctly not found in offset_queue_table\n");
+  } else {
+    pr_err("Removed offset incorrectly found in offset_queue_table\n");
+  }
+
+  // Released offsets are handed out again
+  loff_t first = offset_queue_fetch_next(&offset_table, 3);
+  loff_t second = offset_queue_fetch_next(&offset_table, 3);
+  offset_queue_table_insert(&offset_table, first, mock_netdev,
+                            mock_offset_queue);
+  offset_queue_release(&offset_table, first, 3);
+  loff_t again = offset_queue_fetch_next(&offset_table, 3);
+  if (first >= 0 && second == first + 3 * PAGE_SIZE && again == first &&
+      !offset_queue_table_lookup(&offset_table, first)) {
+    pr_info("Released offsets correctly reused\n");
+  } else {
+    pr_err("Released offsets not reused\n");
+  }
+
+  // More offsets than the initial bitmap holds
+  loff_t large = offset_queue_fetch_next(&offset_table, 2 * 4096);
+  if (large >= 0 && large > second) {
+    pr_info("Offset bitmap correctly grown\n");
+  } else {
+    pr_err("Offset bitmap not grown\n");
+  }
+
   offset_queue_table_clear(&offset_table);
+  rcu_barrier();
 }
 
 static int __init map_test_init(void) {
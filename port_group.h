@@ -0,0 +1,119 @@
+#ifndef _XSP_PORT_GROUP_H
+#define _XSP_PORT_GROUP_H
+
+#include <linux/kernel.h>
+#include <linux/netdevice.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+/// # NOTE
+/// Port groups name a set of egress devices by a small id, so that a single
+/// tx descriptor can fan a packet out to all of them. Lookups are lock-free
+/// under rcu, updates are serialized by the table spinlock. Groups do not
+/// hold a reference to their devices, the owner must remove a device from
+/// every group before releasing it. Removed members are left as NULL.
+
+#define PORT_GROUP_TABLE_SIZE 4096
+
+struct port_group {
+  u32 num;
+  struct rcu_head rcu;
+  struct net_device *devs[];
+};
+
+struct port_group_table {
+  struct port_group __rcu *groups[PORT_GROUP_TABLE_SIZE];
+  spinlock_t lock;
+};
+
+void port_group_table_init(struct port_group_table *table);
+int port_group_table_set(struct port_group_table *table, u32 id,
+                         struct net_device **devs, u32 num);
+struct port_group *port_group_table_lookup(struct port_group_table *table,
+                                           u32 id);
+void port_group_table_remove_dev(struct port_group_table *table,
+                                 struct net_device *dev);
+void port_group_table_clear(struct port_group_table *table);
+
+void port_group_table_init(struct port_group_table *table) {
+  for (int i = 0; i < PORT_GROUP_TABLE_SIZE; i++) {
+    RCU_INIT_POINTER(table->groups[i], NULL);
+  }
+  spin_lock_init(&table->lock);
+}
+
+// Replace the members of group id with devs, no members removes the group.
+int port_group_table_set(struct port_group_table *table, u32 id,
+                         struct net_device **devs, u32 num) {
+  struct port_group *group = NULL;
+  struct port_group *old = NULL;
+
+  if (id >= PORT_GROUP_TABLE_SIZE) {
+    return -EINVAL;
+  }
+  if (num) {
+    group = kzalloc(struct_size(group, devs, num), GFP_KERNEL);
+    if (!group) {
+      return -ENOMEM;
+    }
+    group->num = num;
+    memcpy(group->devs, devs, num * sizeof(*devs));
+  }
+
+  spin_lock(&table->lock);
+  old = rcu_replace_pointer(table->groups[id], group,
+                            lockdep_is_held(&table->lock));
+  spin_unlock(&table->lock);
+  if (old) {
+    kfree_rcu(old, rcu);
+  }
+  return 0;
+}
+
+// Must be called under rcu_read_lock(), the returned group is only valid
+// within the read side critical section. Members may be NULL.
+struct port_group *port_group_table_lookup(struct port_group_table *table,
+                                           u32 id) {
+  if (id >= PORT_GROUP_TABLE_SIZE) {
+    return NULL;
+  }
+  return rcu_dereference(table->groups[id]);
+}
+
+// Remove dev from every group.
+void port_group_table_remove_dev(struct port_group_table *table,
+                                 struct net_device *dev) {
+  struct port_group *group = NULL;
+
+  spin_lock(&table->lock);
+  for (int i = 0; i < PORT_GROUP_TABLE_SIZE; i++) {
+    group = rcu_dereference_protected(table->groups[i],
+                                      lockdep_is_held(&table->lock));
+    if (!group) {
+      continue;
+    }
+    for (u32 j = 0; j < group->num; j++) {
+      if (group->devs[j] == dev) {
+        WRITE_ONCE(group->devs[j], NULL);
+      }
+    }
+  }
+  spin_unlock(&table->lock);
+}
+
+void port_group_table_clear(struct port_group_table *table) {
+  struct port_group *group = NULL;
+
+  spin_lock(&table->lock);
+  for (int i = 0; i < PORT_GROUP_TABLE_SIZE; i++) {
+    group = rcu_replace_pointer(table->groups[i], NULL,
+                                lockdep_is_held(&table->lock));
+    if (group) {
+      kfree_rcu(group, rcu);
+    }
+  }
+  spin_unlock(&table->lock);
+}
+
+#endif
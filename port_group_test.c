@@ -0,0 +1,76 @@
+#include "port_group.h"
+#include <linux/module.h>
+
+static struct port_group_table port_groups;
+
+static void test_port_group(void) {
+  struct net_device *dev1 = (struct net_device *)0x12345678;
+  struct net_device *dev2 = (struct net_device *)0x87654321;
+  struct net_device *devs[] = {dev1, dev2};
+  struct port_group *group = NULL;
+
+  port_group_table_init(&port_groups);
+
+  // Set and lookup
+  if (port_group_table_set(&port_groups, 7, devs, 2) != 0) {
+    pr_err("Failed to set port group\n");
+  }
+  rcu_read_lock();
+  group = port_group_table_lookup(&port_groups, 7);
+  if (group && group->num == 2 && group->devs[0] == dev1 &&
+      group->devs[1] == dev2) {
+    pr_info("Port group found with correct members\n");
+  } else {
+    pr_err("Port group not found\n");
+  }
+  rcu_read_unlock();
+
+  // Ids out of range
+  if (port_group_table_set(&port_groups, PORT_GROUP_TABLE_SIZE, devs, 2) ==
+      -EINVAL) {
+    pr_info("Out of range group id correctly rejected\n");
+  } else {
+    pr_err("Out of range group id incorrectly accepted\n");
+  }
+
+  // Removed devices are left as NULL members
+  port_group_table_remove_dev(&port_groups, dev1);
+  rcu_read_lock();
+  group = port_group_table_lookup(&port_groups, 7);
+  if (group && !group->devs[0] && group->devs[1] == dev2) {
+    pr_info("Removed dev correctly cleared from port group\n");
+  } else {
+    pr_err("Removed dev still in port group\n");
+  }
+  rcu_read_unlock();
+
+  // No members removes the group
+  port_group_table_set(&port_groups, 7, NULL, 0);
+  rcu_read_lock();
+  group = port_group_table_lookup(&port_groups, 7);
+  rcu_read_unlock();
+  if (!group) {
+    pr_info("Empty port group correctly removed\n");
+  } else {
+    pr_err("Empty port group incorrectly found\n");
+  }
+
+  port_group_table_clear(&port_groups);
+  rcu_barrier();
+}
+
+static int __init port_group_test_init(void) {
+  test_port_group();
+
+  return 0;
+}
+
+static void __exit port_group_test_exit(void) {}
+
+module_init(port_group_test_init);
+module_exit(port_group_test_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("ZENOTME");
+MODULE_DESCRIPTION("Test module for port_group");
+MODULE_VERSION("1.0");
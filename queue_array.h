@@ -1,20 +1,35 @@
 #include "xsp_queue.h"
+#include <linux/cpumask.h>
 #include <linux/spinlock.h>
 
+// Default entries of a ring
 #define QUEUE_ENTRY_NUM 4096
 
 #define FOR_EACH_QUEUE(queue_array, i)                                         \
   for (size_t i = 0; i < queue_array->size; i++)
 
+// Like FOR_EACH_QUEUE, but skips empty slots (e.g. the ones of offline cpus
+// in a per-cpu queue array) and sets q to the queue of slot i.
+#define FOR_EACH_PRESENT_QUEUE(queue_array, i, q)                              \
+  FOR_EACH_QUEUE(queue_array, i)                                               \
+  if (!((q) = READ_ONCE(queue_array->queue[i]))) {                             \
+  } else
+
 struct queue_array {
   size_t size;
   struct xsp_queue *queue[0];
 };
 
-struct queue_array *queue_array_create(size_t size);
+struct queue_array *queue_array_create(size_t size, u32 nentries,
+                                       u32 desc_size, int node);
+struct queue_array *queue_array_create_percpu(const struct cpumask *mask,
+                                              u32 nentries, u32 desc_size);
 void queue_array_destroy(struct queue_array *queue_array);
 
-struct queue_array *queue_array_create(size_t size) {
+// Create size queues of nentries entries, desc_size bytes each, on NUMA
+// node node.
+struct queue_array *queue_array_create(size_t size, u32 nentries,
+                                       u32 desc_size, int node) {
   // Allocate memory for queue array
   struct queue_array *queue_array =
       kmalloc(sizeof(struct queue_array) + sizeof(struct xsp_queue *) * size,
@@ -25,7 +40,8 @@ struct queue_array *queue_array_create(size_t size) {
   // Allocate memory for each queue
   size_t cur_queue_idx = 0;
   for (; cur_queue_idx < size; cur_queue_idx++) {
-    queue_array->queue[cur_queue_idx] = xspq_create(QUEUE_ENTRY_NUM);
+    queue_array->queue[cur_queue_idx] =
+        xspq_create_desc_node(nentries, desc_size, node);
     if (!queue_array->queue[cur_queue_idx]) {
       goto err;
     }
@@ -42,6 +58,30 @@ err:
   return NULL;
 }
 
+// Create a queue array with one slot per possible cpu id, only the cpus in
+// mask get a queue, allocated on the node of its cpu. The queue of another
+// cpu can be added later with smp_store_release() once it is fully set up.
+struct queue_array *queue_array_create_percpu(const struct cpumask *mask,
+                                              u32 nentries, u32 desc_size) {
+  struct queue_array *queue_array =
+      kzalloc(struct_size(queue_array, queue, nr_cpu_ids), GFP_KERNEL);
+  if (!queue_array) {
+    return NULL;
+  }
+  queue_array->size = nr_cpu_ids;
+
+  int cpu;
+  for_each_cpu(cpu, mask) {
+    queue_array->queue[cpu] =
+        xspq_create_desc_node(nentries, desc_size, cpu_to_node(cpu));
+    if (!queue_array->queue[cpu]) {
+      queue_array_destroy(queue_array);
+      return NULL;
+    }
+  }
+  return queue_array;
+}
+
 void queue_array_destroy(struct queue_array *queue_array) {
   // Free each queue
   for (size_t i = 0; i < queue_array->size; i++) {
@@ -67,6 +107,8 @@ struct queue_array_list {
 inline void queue_array_list_init(struct queue_array_list *array_list);
 inline void queue_array_list_insert(struct queue_array_list *array_list,
                                     struct queue_array *queue_array);
+inline void queue_array_list_remove(struct queue_array_list *array_list,
+                                    struct queue_array *queue_array);
 inline void queue_array_list_destroy(struct queue_array_list *array_list);
 
 inline void queue_array_list_init(struct queue_array_list *array_list) {
@@ -87,6 +129,28 @@ inline void queue_array_list_insert(struct queue_array_list *array_list,
   spin_unlock(&(array_list->lock));
 }
 
+// Take queue_array out of the list and destroy it, e.g. when its device is
+// unbound.
+inline void queue_array_list_remove(struct queue_array_list *array_list,
+                                    struct queue_array *queue_array) {
+  struct queue_array_list_entry *entry, *found = NULL;
+
+  spin_lock(&(array_list->lock));
+  list_for_each_entry(entry, &(array_list->list), list) {
+    if (entry->queue == queue_array) {
+      list_del(&(entry->list));
+      found = entry;
+      break;
+    }
+  }
+  spin_unlock(&(array_list->lock));
+
+  if (found) {
+    kfree(found);
+  }
+  queue_array_destroy(queue_array);
+}
+
 inline void queue_array_list_destroy(struct queue_array_list *array_list) {
   struct queue_array_list_entry *entry, *tmp;
   LIST_HEAD(to_free_list);
@@ -11,7 +11,8 @@ static int __init test_queue_array_init(void) {
     printk(KERN_INFO "Initializing test for queue_array and queue_array_list\n");
 
     // 创建 queue_array
-    q_array = queue_array_create(10);
+    q_array = queue_array_create(10, QUEUE_ENTRY_NUM,
+                                 sizeof(struct ring_entry), NUMA_NO_NODE);
     if (!q_array) {
         printk(KERN_ERR "Failed to create queue_array\n");
         return -ENOMEM;
@@ -26,6 +27,22 @@ static int __init test_queue_array_init(void) {
     queue_array_list_insert(&q_array_list, q_array);
     printk(KERN_INFO "queue_array inserted into queue_array_list\n");
 
+    // 从 queue_array_list 移除并销毁一个 queue_array
+    struct queue_array *removed = queue_array_create(
+        2, QUEUE_ENTRY_NUM, sizeof(struct ring_entry), numa_node_id());
+    if (removed) {
+        if (removed->queue[0]->node != numa_node_id()) {
+            printk(KERN_ERR "queue_array not on the requested node\n");
+        }
+        queue_array_list_insert(&q_array_list, removed);
+        queue_array_list_remove(&q_array_list, removed);
+        if (list_is_singular(&q_array_list.list)) {
+            printk(KERN_INFO "queue_array removed from queue_array_list\n");
+        } else {
+            printk(KERN_ERR "queue_array still in queue_array_list\n");
+        }
+    }
+
     // 销毁 queue_array_list
     queue_array_list_destroy(&q_array_list);
     printk(KERN_INFO "queue_array_list destroyed\n");
@@ -34,6 +51,36 @@ static int __init test_queue_array_init(void) {
     queue_array_destroy(q_array);
     printk(KERN_INFO "queue_array destroyed\n");
 
+    // 创建 per-cpu queue_array, 只有 mask 中的 cpu 有 queue
+    q_array = queue_array_create_percpu(cpumask_of(0), 64,
+                                        sizeof(struct xsp_rx_desc_ext));
+    if (!q_array) {
+        printk(KERN_ERR "Failed to create per-cpu queue_array\n");
+        return -ENOMEM;
+    }
+    size_t present = 0;
+    struct xsp_queue *q;
+    FOR_EACH_PRESENT_QUEUE(q_array, i, q) {
+        present++;
+    }
+    if (q_array->size != nr_cpu_ids || present != 1 || !q_array->queue[0] ||
+        q_array->queue[0]->nentries != 64 ||
+        q_array->queue[0]->desc_size != sizeof(struct xsp_rx_desc_ext) ||
+        q_array->queue[0]->node != cpu_to_node(0)) {
+        printk(KERN_ERR "per-cpu queue_array size: %zu present: %zu\n",
+               q_array->size, present);
+    }
+    queue_array_destroy(q_array);
+    printk(KERN_INFO "per-cpu queue_array destroyed\n");
+
+    // ring 深度必须是 2 的幂
+    q_array =
+        queue_array_create(1, 100, sizeof(struct ring_entry), NUMA_NO_NODE);
+    if (q_array) {
+        printk(KERN_ERR "queue_array created with invalid ring depth\n");
+        queue_array_destroy(q_array);
+    }
+
     return 0;
 }
 
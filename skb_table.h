@@ -0,0 +1,292 @@
+#ifndef _XSP_SKB_TABLE_H
+#define _XSP_SKB_TABLE_H
+
+#include <linux/kernel.h>
+#include <linux/skbuff.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/xarray.h>
+
+/// # NOTE
+/// Skbs handed to userspace are parked in a pre-allocated slot table and
+/// named by an opaque handle instead of their kernel address:
+///
+///   | generation (24) | table id (18) | slot (22) |
+///
+/// The generation of a slot is bumped on every use, so a stale or
+/// duplicated handle never matches the slot again and is rejected with a
+/// single array index and cmpxchg. A handle is never 0.
+///
+/// Each table has a single allocating context (the producer of the rx queue
+/// owning it) which takes free slots from a private cache. Slots are claimed
+/// by any sender and given back in bulk to the shared free list, the cache
+/// is refilled from it in bulk as well.
+///
+/// A table may also own a frame area with a frame_size window per slot,
+/// mapped into userspace to expose the packet headers of parked skbs.
+
+#define SKB_TABLE_SLOT_BITS 22
+#define SKB_TABLE_ID_BITS 18
+#define SKB_TABLE_GEN_BITS 24
+#define SKB_TABLE_MAX_SIZE (1U << SKB_TABLE_SLOT_BITS)
+#define SKB_TABLE_ID_MAX ((1U << SKB_TABLE_ID_BITS) - 1)
+#define SKB_TABLE_GEN_MASK ((1U << SKB_TABLE_GEN_BITS) - 1)
+// Free slots moved between the cache and the free list at once
+#define SKB_TABLE_CACHE_SIZE 64
+
+struct skb_table_slot {
+  // Handle of the parked skb, 0 when the slot is not in use
+  u64 handle;
+  struct sk_buff *skb;
+  // Generation of the last handle of this slot
+  u32 gen;
+  // Bytes of the packet in the frame window of this slot
+  u32 frame_len;
+};
+
+struct skb_table {
+  u32 id;
+  u32 size;
+  struct xarray *registry;
+  // vzalloc_node() area of size frames, NULL if frame_size is 0
+  void *frames;
+  u32 frame_size;
+  size_t frames_vmalloc_size;
+  // Free slots private to the allocating context
+  u32 cache_num;
+  u32 cache[SKB_TABLE_CACHE_SIZE];
+  // Free slots released by the senders
+  spinlock_t lock;
+  u32 free_num;
+  u32 *free_list;
+  struct skb_table_slot slots[];
+};
+
+// Slots released by a sender, given back to their table in bulk. Handles of
+// another table flush the batch first.
+struct skb_table_batch {
+  struct skb_table *table;
+  u32 num;
+  u32 slot[SKB_TABLE_CACHE_SIZE];
+};
+
+struct skb_table *skb_table_create(struct xarray *registry, u32 size,
+                                   u32 frame_size, int node);
+void skb_table_unregister(struct skb_table *table);
+void skb_table_destroy(struct skb_table *table);
+void skb_table_registry_destroy(struct xarray *registry);
+u64 skb_table_alloc(struct skb_table *table, struct sk_buff *skb);
+struct sk_buff *skb_table_claim(struct xarray *registry, u64 handle,
+                                struct skb_table_batch *batch);
+void skb_table_batch_flush(struct skb_table_batch *batch);
+
+static inline u32 skb_table_handle_slot(u64 handle) {
+  return handle & (SKB_TABLE_MAX_SIZE - 1);
+}
+
+static inline u32 skb_table_handle_id(u64 handle) {
+  return (handle >> SKB_TABLE_SLOT_BITS) & SKB_TABLE_ID_MAX;
+}
+
+static inline u64 skb_table_make_handle(u32 gen, u32 id, u32 slot) {
+  return ((u64)gen << (SKB_TABLE_SLOT_BITS + SKB_TABLE_ID_BITS)) |
+         ((u64)id << SKB_TABLE_SLOT_BITS) | slot;
+}
+
+// Byte offset of the frame window of a slot in the frame area
+static inline size_t skb_table_frame_offset(struct skb_table *table,
+                                            u32 slot) {
+  return (size_t)slot * table->frame_size;
+}
+
+static inline void *skb_table_frame(struct skb_table *table, u32 slot) {
+  return table->frames + skb_table_frame_offset(table, slot);
+}
+
+// Size of the frame area of a table, 0 if it has none
+static inline size_t skb_table_frames_size_for(u32 size, u32 frame_size) {
+  return PAGE_ALIGN(size_mul(size, frame_size));
+}
+
+// Create a table of size slots and register it in registry, an xarray
+// initialized with XA_FLAGS_ALLOC1. A frame_size window per slot is
+// allocated unless it is 0. Everything is allocated on NUMA node node, the
+// frame area is not VM_USERMAP and has to be mapped page by page.
+struct skb_table *skb_table_create(struct xarray *registry, u32 size,
+                                   u32 frame_size, int node) {
+  struct skb_table *table = NULL;
+  int ret;
+
+  if (!size || size > SKB_TABLE_MAX_SIZE) {
+    return NULL;
+  }
+  table = vzalloc_node(struct_size(table, slots, size), node);
+  if (!table) {
+    return NULL;
+  }
+  table->free_list = kvmalloc_node(size * sizeof(u32), GFP_KERNEL, node);
+  if (!table->free_list) {
+    vfree(table);
+    return NULL;
+  }
+  if (frame_size) {
+    table->frames_vmalloc_size = skb_table_frames_size_for(size, frame_size);
+    table->frames = vzalloc_node(table->frames_vmalloc_size, node);
+    if (!table->frames) {
+      kvfree(table->free_list);
+      vfree(table);
+      return NULL;
+    }
+    table->frame_size = frame_size;
+  }
+  table->size = size;
+  table->registry = registry;
+  spin_lock_init(&table->lock);
+  for (u32 i = 0; i < size; i++) {
+    table->free_list[i] = size - 1 - i;
+  }
+  table->free_num = size;
+
+  ret = xa_alloc(registry, &table->id, table,
+                 XA_LIMIT(1, SKB_TABLE_ID_MAX), GFP_KERNEL);
+  if (ret) {
+    vfree(table->frames);
+    kvfree(table->free_list);
+    vfree(table);
+    return NULL;
+  }
+  return table;
+}
+
+// Take a table out of its registry, its handles can not be claimed anymore.
+// Claims already in flight may still use the table until they are done.
+void skb_table_unregister(struct skb_table *table) {
+  if (!table || !table->registry) {
+    return;
+  }
+  xa_erase(table->registry, table->id);
+  table->registry = NULL;
+}
+
+// Free a table and every skb still parked in it. Nobody may use the table
+// anymore.
+void skb_table_destroy(struct skb_table *table) {
+  if (!table) {
+    return;
+  }
+  skb_table_unregister(table);
+  for (u32 i = 0; i < table->size; i++) {
+    if (table->slots[i].handle) {
+      kfree_skb(table->slots[i].skb);
+    }
+  }
+  vfree(table->frames);
+  kvfree(table->free_list);
+  vfree(table);
+}
+
+void skb_table_registry_destroy(struct xarray *registry) {
+  struct skb_table *table = NULL;
+  unsigned long id;
+
+  xa_for_each(registry, id, table) {
+    skb_table_destroy(table);
+  }
+  xa_destroy(registry);
+}
+
+static bool skb_table_refill(struct skb_table *table) {
+  spin_lock_bh(&table->lock);
+  while (table->free_num && table->cache_num < SKB_TABLE_CACHE_SIZE) {
+    table->cache[table->cache_num++] = table->free_list[--table->free_num];
+  }
+  spin_unlock_bh(&table->lock);
+  return table->cache_num;
+}
+
+// Park skb in a free slot, returns its handle or 0 if the table is full.
+// Only called by the allocating context of the table.
+u64 skb_table_alloc(struct skb_table *table, struct sk_buff *skb) {
+  struct skb_table_slot *slot = NULL;
+  u64 handle;
+  u32 idx;
+
+  if (unlikely(!table->cache_num) && !skb_table_refill(table)) {
+    return 0;
+  }
+  idx = table->cache[--table->cache_num];
+  slot = &table->slots[idx];
+  slot->gen = (slot->gen + 1) & SKB_TABLE_GEN_MASK;
+  if (unlikely(!slot->gen)) {
+    slot->gen = 1;
+  }
+  slot->skb = skb;
+  handle = skb_table_make_handle(slot->gen, table->id, idx);
+  // Pairs with the cmpxchg() in skb_table_claim()
+  smp_store_release(&slot->handle, handle);
+  return handle;
+}
+
+// Take the skb named by handle out of its table, NULL if the handle is
+// invalid, stale or was already claimed. The slot is added to batch, which
+// the caller flushes with skb_table_batch_flush().
+struct sk_buff *skb_table_claim(struct xarray *registry, u64 handle,
+                                struct skb_table_batch *batch) {
+  struct skb_table *table = batch->table;
+  struct skb_table_slot *slot = NULL;
+  u32 idx = skb_table_handle_slot(handle);
+
+  if (!table || table->id != skb_table_handle_id(handle)) {
+    table = xa_load(registry, skb_table_handle_id(handle));
+    if (unlikely(!table)) {
+      return NULL;
+    }
+  }
+  if (unlikely(idx >= table->size)) {
+    return NULL;
+  }
+  slot = &table->slots[idx];
+  if (READ_ONCE(slot->handle) != handle ||
+      cmpxchg(&slot->handle, handle, 0) != handle) {
+    return NULL;
+  }
+
+  if (batch->table != table || batch->num == SKB_TABLE_CACHE_SIZE) {
+    skb_table_batch_flush(batch);
+    batch->table = table;
+  }
+  batch->slot[batch->num++] = idx;
+  return slot->skb;
+}
+
+// Frame window of the slot claimed last into batch and the bytes of the
+// packet in it, NULL if the table has no frames.
+static inline void *skb_table_claimed_frame(struct skb_table_batch *batch,
+                                            u32 *len) {
+  struct skb_table *table = batch->table;
+  u32 slot = batch->slot[batch->num - 1];
+
+  if (!table->frames) {
+    return NULL;
+  }
+  *len = table->slots[slot].frame_len;
+  return skb_table_frame(table, slot);
+}
+
+// Give the slots of batch back to their table.
+void skb_table_batch_flush(struct skb_table_batch *batch) {
+  struct skb_table *table = batch->table;
+
+  if (!batch->num) {
+    return;
+  }
+  spin_lock_bh(&table->lock);
+  for (u32 i = 0; i < batch->num; i++) {
+    table->free_list[table->free_num++] = batch->slot[i];
+  }
+  spin_unlock_bh(&table->lock);
+  batch->num = 0;
+}
+
+#endif
@@ -0,0 +1,121 @@
+#include "skb_table.h"
+#include <linux/module.h>
+
+static DEFINE_XARRAY_ALLOC1(registry);
+
+static void test_skb_table(void) {
+  struct skb_table_batch batch = {0};
+  struct skb_table *table = NULL;
+  struct sk_buff *skb = NULL;
+  struct sk_buff *found = NULL;
+  u64 handle, stale_handle;
+
+  table = skb_table_create(&registry, 4, 0, NUMA_NO_NODE);
+  if (!table) {
+    pr_err("Failed to create skb table\n");
+    return;
+  }
+
+  // Alloc and claim
+  skb = alloc_skb(64, GFP_KERNEL);
+  if (!skb) {
+    pr_err("Failed to allocate skb\n");
+    skb_table_destroy(table);
+    return;
+  }
+  handle = skb_table_alloc(table, skb);
+  found = skb_table_claim(&registry, handle, &batch);
+  if (handle && found == skb) {
+    pr_info("Skb claimed by its handle\n");
+  } else {
+    pr_err("Skb not claimed by its handle\n");
+  }
+
+  // A handle can only be claimed once
+  if (!skb_table_claim(&registry, handle, &batch)) {
+    pr_info("Duplicated handle correctly rejected\n");
+  } else {
+    pr_err("Duplicated handle incorrectly claimed\n");
+  }
+  skb_table_batch_flush(&batch);
+
+  // Fill the table, the slot of the first handle is used again with
+  // another generation.
+  stale_handle = handle;
+  u64 handles[4];
+  for (int i = 0; i < 4; i++) {
+    handles[i] = skb_table_alloc(table, skb);
+  }
+  if (skb_table_alloc(table, skb) == 0) {
+    pr_info("Full skb table correctly rejects alloc\n");
+  } else {
+    pr_err("Full skb table incorrectly allocates\n");
+  }
+  if (!skb_table_claim(&registry, stale_handle, &batch)) {
+    pr_info("Stale handle correctly rejected\n");
+  } else {
+    pr_err("Stale handle incorrectly claimed\n");
+  }
+
+  // Bulk release
+  for (int i = 0; i < 4; i++) {
+    if (skb_table_claim(&registry, handles[i], &batch) != skb) {
+      pr_err("Failed to claim handle %d\n", i);
+    }
+  }
+  skb_table_batch_flush(&batch);
+  if (table->free_num == 4) {
+    pr_info("Claimed slots released in bulk\n");
+  } else {
+    pr_err("Free slots after bulk release: %u\n", table->free_num);
+  }
+
+  // Handles of unknown tables
+  if (!skb_table_claim(&registry, skb_table_make_handle(1, 1000, 0),
+                       &batch)) {
+    pr_info("Handle of unknown table correctly rejected\n");
+  } else {
+    pr_err("Handle of unknown table incorrectly claimed\n");
+  }
+
+  // Frame windows are frame_size apart
+  struct skb_table *framed =
+      skb_table_create(&registry, 4, 128, NUMA_NO_NODE);
+  if (framed && framed->frames &&
+      skb_table_frame(framed, 3) == framed->frames + 3 * 128) {
+    pr_info("Frame windows correctly laid out\n");
+  } else {
+    pr_err("Frame windows not laid out\n");
+  }
+
+  // Unregistered tables are no longer found by their handles
+  if (framed) {
+    u32 id = framed->id;
+    skb_table_unregister(framed);
+    if (!xa_load(&registry, id)) {
+      pr_info("Unregistered table correctly removed from registry\n");
+    } else {
+      pr_err("Unregistered table still in registry\n");
+    }
+    skb_table_destroy(framed);
+  }
+
+  kfree_skb(skb);
+  skb_table_registry_destroy(&registry);
+}
+
+static int __init skb_table_test_init(void) {
+  test_skb_table();
+
+  return 0;
+}
+
+static void __exit skb_table_test_exit(void) {}
+
+module_init(skb_table_test_init);
+module_exit(skb_table_test_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("ZENOTME");
+MODULE_DESCRIPTION("Test module for skb_table");
+MODULE_VERSION("1.0");
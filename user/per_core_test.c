@@ -20,6 +20,10 @@ struct forward_task {
   uint32_t rx_queue_size;
   struct xsp_queue *tx_queue;
   loff_t tx_index;
+  // NUMA node of the rx queues, -1 if the task has none
+  int node;
+  // Eventfd of the rx queues, shared by the tasks of a thread
+  int efd;
 };
 
 struct forward_task_array {
@@ -27,8 +31,9 @@ struct forward_task_array {
   struct forward_task *tasks[0];
 };
 
-static inline void execute_task_once(uint64_t *buffer, uint32_t buffer_size,
-                                     struct forward_task *task) {
+static inline uint64_t execute_task_once(uint64_t *buffer,
+                                         uint32_t buffer_size,
+                                         struct forward_task *task) {
   struct xsp_queue *rx_queue = NULL;
   uint64_t receive_end = 0;
   uint64_t send_end = 0;
@@ -41,6 +46,9 @@ static inline void execute_task_once(uint64_t *buffer, uint32_t buffer_size,
         receive_pkt(buffer, receive_end, buffer_size - receive_end, rx_queue);
     receive_end += reserve;
   }
+  if (!receive_end) {
+    return 0;
+  }
 
   // send
   while (send_end < receive_end) {
@@ -52,6 +60,7 @@ static inline void execute_task_once(uint64_t *buffer, uint32_t buffer_size,
     }
   }
   ioctl(task->fd, IOCTL_SEND, task->tx_index);
+  return receive_end;
 }
 
 static inline void
@@ -71,13 +80,66 @@ execute_forward_tasks(struct forward_task_array *task_array) {
   assert(buffer);
   printf("buffser size: %u\n", buffer_size);
 
+  uint32_t idle_rounds = 0;
   while (1) {
+    uint64_t received = 0;
     for (int i = 0; i < task_size; i++) {
-      execute_task_once(buffer, buffer_size, tasks[i]);
+      received += execute_task_once(buffer, buffer_size, tasks[i]);
+    }
+    if (received) {
+      idle_rounds = 0;
+    } else if (++idle_rounds >= IDLE_SPIN_ROUNDS) {
+      // Only the rx queues of this thread wake it up
+      int ready = 0;
+      for (int i = 0; i < task_size; i++) {
+        ready |= rx_rings_need_wakeup(tasks[i]->rx_queues,
+                                      tasks[i]->rx_queue_size);
+      }
+      if (!ready) {
+        wait_rx_eventfd(tasks[0]->efd, -1);
+      }
+      idle_rounds = 0;
     }
   }
 }
 
+// Hand the present rx queues of result to the tasks, queues of the same NUMA
+// node go to the same tasks, so that each thread can run next to its rings.
+static void assign_rx_queues(const struct bind_dev_result *result,
+                             struct forward_task *tasks, uint32_t thread_num) {
+  uint64_t *slots = (uint64_t *)malloc(sizeof(uint64_t) * result->rx_queue_num);
+  uint64_t present = 0;
+  assert(slots);
+
+  // Rx queue slots of offline cpus have no queue, the others are sorted by
+  // node
+  for (uint64_t i = 0; i < result->rx_queue_num; i++) {
+    if (!result->rx_queue[i]) {
+      continue;
+    }
+    uint64_t j = present++;
+    for (; j > 0 && result->stats->queues[slots[j - 1]].node >
+                        result->stats->queues[i].node;
+         j--) {
+      slots[j] = slots[j - 1];
+    }
+    slots[j] = i;
+  }
+  for (uint64_t k = 0; k < present; k++) {
+    struct forward_task *task = &tasks[k * thread_num / present];
+    if (!task->rx_queue_size) {
+      task->node = result->stats->queues[slots[k]].node;
+    }
+    task->rx_queues[task->rx_queue_size++] = result->rx_queue[slots[k]];
+    int ret = set_rx_eventfd(task->fd,
+                             result->dev_info.rx_start_offset +
+                                 slots[k] * result->dev_info.step,
+                             task->efd);
+    assert(ret == 0);
+  }
+  free(slots);
+}
+
 static void *thread_func(void *arg) {
   assert(arg);
   execute_forward_tasks(arg);
@@ -97,10 +159,17 @@ int main(int argc, char *argv[]) {
     exit(EXIT_FAILURE);
   }
 
-  struct bind_dev_info dev1_info;
-  struct bind_dev_info dev2_info;
+  // Zeroed geometry requests the default queue number and ring depth
+  struct bind_dev_info dev1_info = {0};
+  struct bind_dev_info dev2_info = {0};
   strcpy(dev1_info.dev_name, argv[1]);
   strcpy(dev2_info.dev_name, argv[2]);
+  // Only handles are passed around, four compact descriptors share a cache
+  // line
+  dev1_info.rx_desc_format = XSP_DESC_FORMAT_COMPACT;
+  dev1_info.tx_desc_format = XSP_DESC_FORMAT_COMPACT;
+  dev2_info.rx_desc_format = XSP_DESC_FORMAT_COMPACT;
+  dev2_info.tx_desc_format = XSP_DESC_FORMAT_COMPACT;
 
   printf("bind dev1: %s\n", dev1_info.dev_name);
   printf("bind dev2: %s\n", dev2_info.dev_name);
@@ -113,51 +182,54 @@ int main(int argc, char *argv[]) {
   print_bind_dev_result(&dev1_result);
   print_bind_dev_result(&dev2_result);
 
-  // partition task
+  // partition task, a tx queue can not be shared by threads
+  uint32_t thread_num = THREAD_POOL_SIZE;
+  if (thread_num > dev1_result.tx_queue_num) {
+    thread_num = dev1_result.tx_queue_num;
+  }
+  if (thread_num > dev2_result.tx_queue_num) {
+    thread_num = dev2_result.tx_queue_num;
+  }
   struct forward_task *dev1_tasks = (struct forward_task *)malloc(
-      sizeof(struct forward_task) * THREAD_POOL_SIZE);
+      sizeof(struct forward_task) * thread_num);
   assert(dev1_tasks);
   struct forward_task *dev2_tasks = (struct forward_task *)malloc(
-      sizeof(struct forward_task) * THREAD_POOL_SIZE);
+      sizeof(struct forward_task) * thread_num);
   assert(dev2_tasks);
-  for (int i = 0; i < THREAD_POOL_SIZE; i++) {
+  for (int i = 0; i < thread_num; i++) {
+    int efd = eventfd(0, EFD_NONBLOCK);
+    assert(efd >= 0);
     dev1_tasks[i].rx_queues = (struct xsp_queue **)malloc(
         sizeof(struct xsp_queue *) *
-        (dev1_result.rx_queue_num / THREAD_POOL_SIZE + 1));
+        (dev1_result.rx_queue_num / thread_num + 1));
     assert(dev1_tasks[i].rx_queues);
     dev1_tasks[i].rx_queue_size = 0;
+    dev1_tasks[i].node = -1;
     assert(i < dev2_result.tx_queue_num && dev2_result.tx_queue[i]);
     dev1_tasks[i].tx_queue = dev2_result.tx_queue[i];
     dev1_tasks[i].tx_index =
         dev2_result.dev_info.tx_start_offset + i * dev2_result.dev_info.step;
     dev1_tasks[i].fd = fd;
+    dev1_tasks[i].efd = efd;
 
     dev2_tasks[i].rx_queues = (struct xsp_queue **)malloc(
         sizeof(struct xsp_queue *) *
-        (dev2_result.rx_queue_num / THREAD_POOL_SIZE + 1));
+        (dev2_result.rx_queue_num / thread_num + 1));
     assert(dev2_tasks[i].rx_queues);
     dev2_tasks[i].rx_queue_size = 0;
+    dev2_tasks[i].node = -1;
     assert(i < dev1_result.tx_queue_num && dev1_result.tx_queue[i]);
     dev2_tasks[i].tx_queue = dev1_result.tx_queue[i];
     dev2_tasks[i].tx_index =
         dev1_result.dev_info.tx_start_offset + i * dev1_result.dev_info.step;
     dev2_tasks[i].fd = fd;
+    dev2_tasks[i].efd = efd;
   }
-  for (int i = 0; i < dev1_result.rx_queue_num;) {
-    for (int j = 0; j < THREAD_POOL_SIZE && i < dev2_result.rx_queue_num; j++) {
-      dev1_tasks[j].rx_queues[dev1_tasks[j].rx_queue_size++] =
-          dev1_result.rx_queue[i++];
-    }
-  }
-  for (int i = 0; i < dev2_result.rx_queue_num;) {
-    for (int j = 0; j < THREAD_POOL_SIZE && i < dev2_result.rx_queue_num; j++) {
-      dev2_tasks[j].rx_queues[dev2_tasks[j].rx_queue_size++] =
-          dev2_result.rx_queue[i++];
-    }
-  }
+  assign_rx_queues(&dev1_result, dev1_tasks, thread_num);
+  assign_rx_queues(&dev2_result, dev2_tasks, thread_num);
 
-  pthread_t worker[THREAD_POOL_SIZE];
-  for (int i = 0; i < THREAD_POOL_SIZE; i++) {
+  pthread_t worker[thread_num];
+  for (int i = 0; i < thread_num; i++) {
     struct forward_task_array *task_array = (struct forward_task_array *)malloc(
         sizeof(struct forward_task_array) + 2 * sizeof(struct forward_task *));
     assert(task_array);
@@ -165,10 +237,19 @@ int main(int argc, char *argv[]) {
     task_array->tasks[0] = &dev1_tasks[i];
     task_array->tasks[1] = &dev2_tasks[i];
 
-    pthread_create(&worker[i], NULL, thread_func, task_array);
+    // Run the thread on the node its rx rings were allocated on
+    pthread_attr_t attr;
+    cpu_set_t cpus;
+    pthread_attr_init(&attr);
+    if (dev1_tasks[i].node >= 0 &&
+        node_cpus(&dev1_result, dev1_tasks[i].node, &cpus)) {
+      pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+    pthread_create(&worker[i], &attr, thread_func, task_array);
+    pthread_attr_destroy(&attr);
   }
 
-  for (int i = 0; i < THREAD_POOL_SIZE; i++) {
+  for (int i = 0; i < thread_num; i++) {
     pthread_join(worker[i], NULL);
   }
 
@@ -20,6 +20,8 @@ struct forward_task {
   uint32_t rx_queue_size;
   struct xsp_queue *tx_queue;
   loff_t tx_index;
+  // Eventfd of the rx queues
+  int efd;
 };
 
 static inline void execute_forward_task(struct forward_task *task) {
@@ -36,6 +38,7 @@ static inline void execute_forward_task(struct forward_task *task) {
   printf("buffser size: %u\n", buffer_size);
 
   struct xsp_queue *rx_queue = NULL;
+  uint32_t idle_rounds = 0;
 
   while (1) {
     uint64_t receive_end = 0;
@@ -49,6 +52,17 @@ static inline void execute_forward_task(struct forward_task *task) {
           receive_pkt(buffer, receive_end, buffer_size - receive_end, rx_queue);
       receive_end += reserve;
     }
+    if (!receive_end) {
+      if (++idle_rounds >= IDLE_SPIN_ROUNDS) {
+        // Only the rx queues of this thread wake it up
+        if (!rx_rings_need_wakeup(task->rx_queues, task->rx_queue_size)) {
+          wait_rx_eventfd(task->efd, -1);
+        }
+        idle_rounds = 0;
+      }
+      continue;
+    }
+    idle_rounds = 0;
 
     // send
     while (send_end < receive_end) {
@@ -82,8 +96,9 @@ int main(int argc, char *argv[]) {
     exit(EXIT_FAILURE);
   }
 
-  struct bind_dev_info dev1_info;
-  struct bind_dev_info dev2_info;
+  // Zeroed geometry requests the default queue number and ring depth
+  struct bind_dev_info dev1_info = {0};
+  struct bind_dev_info dev2_info = {0};
   strcpy(dev1_info.dev_name, argv[1]);
   strcpy(dev2_info.dev_name, argv[2]);
 
@@ -98,17 +113,24 @@ int main(int argc, char *argv[]) {
   print_bind_dev_result(&dev1_result);
   print_bind_dev_result(&dev2_result);
 
-  // partition task
+  // partition task, a tx queue can not be shared by threads
+  uint32_t thread_num = NUM_PACKET_THREAD;
+  if (thread_num > dev1_result.tx_queue_num) {
+    thread_num = dev1_result.tx_queue_num;
+  }
+  if (thread_num > dev2_result.tx_queue_num) {
+    thread_num = dev2_result.tx_queue_num;
+  }
   struct forward_task *dev1_tasks = (struct forward_task *)malloc(
-      sizeof(struct forward_task) * NUM_PACKET_THREAD);
+      sizeof(struct forward_task) * thread_num);
   assert(dev1_tasks);
   struct forward_task *dev2_tasks = (struct forward_task *)malloc(
-      sizeof(struct forward_task) * NUM_PACKET_THREAD);
+      sizeof(struct forward_task) * thread_num);
   assert(dev2_tasks);
-  for (int i = 0; i < NUM_PACKET_THREAD; i++) {
+  for (int i = 0; i < thread_num; i++) {
     dev1_tasks[i].rx_queues = (struct xsp_queue **)malloc(
         sizeof(struct xsp_queue *) *
-        (dev1_result.rx_queue_num / NUM_PACKET_THREAD + 1));
+        (dev1_result.rx_queue_num / thread_num + 1));
     assert(dev1_tasks[i].rx_queues);
     dev1_tasks[i].rx_queue_size = 0;
     assert(i < dev2_result.tx_queue_num && dev2_result.tx_queue[i]);
@@ -116,10 +138,12 @@ int main(int argc, char *argv[]) {
     dev1_tasks[i].tx_index =
         dev2_result.dev_info.tx_start_offset + i * dev2_result.dev_info.step;
     dev1_tasks[i].fd = fd;
+    dev1_tasks[i].efd = eventfd(0, EFD_NONBLOCK);
+    assert(dev1_tasks[i].efd >= 0);
 
     dev2_tasks[i].rx_queues = (struct xsp_queue **)malloc(
         sizeof(struct xsp_queue *) *
-        (dev2_result.rx_queue_num / NUM_PACKET_THREAD + 1));
+        (dev2_result.rx_queue_num / thread_num + 1));
     assert(dev2_tasks[i].rx_queues);
     dev2_tasks[i].rx_queue_size = 0;
     assert(i < dev1_result.tx_queue_num && dev1_result.tx_queue[i]);
@@ -127,30 +151,46 @@ int main(int argc, char *argv[]) {
     dev2_tasks[i].tx_index =
         dev1_result.dev_info.tx_start_offset + i * dev1_result.dev_info.step;
     dev2_tasks[i].fd = fd;
+    dev2_tasks[i].efd = eventfd(0, EFD_NONBLOCK);
+    assert(dev2_tasks[i].efd >= 0);
   }
-  for (int i = 0; i < dev1_result.rx_queue_num;) {
-    for (int j = 0; j < NUM_PACKET_THREAD && i < dev2_result.rx_queue_num;
-         j++) {
-      dev1_tasks[j].rx_queues[dev1_tasks[j].rx_queue_size++] =
-          dev1_result.rx_queue[i++];
+  for (int i = 0, j = 0; i < dev1_result.rx_queue_num; i++) {
+    // Rx queue slots of offline cpus have no queue
+    if (!dev1_result.rx_queue[i]) {
+      continue;
     }
+    dev1_tasks[j].rx_queues[dev1_tasks[j].rx_queue_size++] =
+        dev1_result.rx_queue[i];
+    int ret = set_rx_eventfd(fd,
+                             dev1_result.dev_info.rx_start_offset +
+                                 i * dev1_result.dev_info.step,
+                             dev1_tasks[j].efd);
+    assert(ret == 0);
+    j = (j + 1) % thread_num;
   }
-  for (int i = 0; i < dev2_result.rx_queue_num;) {
-    for (int j = 0; j < NUM_PACKET_THREAD && i < dev2_result.rx_queue_num;
-         j++) {
-      dev2_tasks[j].rx_queues[dev2_tasks[j].rx_queue_size++] =
-          dev2_result.rx_queue[i++];
+  for (int i = 0, j = 0; i < dev2_result.rx_queue_num; i++) {
+    // Rx queue slots of offline cpus have no queue
+    if (!dev2_result.rx_queue[i]) {
+      continue;
     }
+    dev2_tasks[j].rx_queues[dev2_tasks[j].rx_queue_size++] =
+        dev2_result.rx_queue[i];
+    int ret = set_rx_eventfd(fd,
+                             dev2_result.dev_info.rx_start_offset +
+                                 i * dev2_result.dev_info.step,
+                             dev2_tasks[j].efd);
+    assert(ret == 0);
+    j = (j + 1) % thread_num;
   }
 
-  pthread_t dev1_thread[NUM_PACKET_THREAD];
-  pthread_t dev2_thread[NUM_PACKET_THREAD];
-  for (int i = 0; i < NUM_PACKET_THREAD; i++) {
+  pthread_t dev1_thread[thread_num];
+  pthread_t dev2_thread[thread_num];
+  for (int i = 0; i < thread_num; i++) {
     pthread_create(&dev1_thread[i], NULL, thread_func, &dev1_tasks[i]);
     pthread_create(&dev2_thread[i], NULL, thread_func, &dev2_tasks[i]);
   }
 
-  for (int i = 0; i < NUM_PACKET_THREAD; i++) {
+  for (int i = 0; i < thread_num; i++) {
     pthread_join(dev1_thread[i], NULL);
     pthread_join(dev2_thread[i], NULL);
   }
@@ -3,7 +3,7 @@
 #include <fcntl.h>
 
 
-static inline void forward_once(uint64_t *buffer, uint64_t buffer_size,
+static inline uint64_t forward_once(uint64_t *buffer, uint64_t buffer_size,
                                 struct bind_dev_result *dev_src_result,
                                 struct bind_dev_result *dev_dst_result) {
   uint64_t receive_end = 0;
@@ -20,9 +20,13 @@ static inline void forward_once(uint64_t *buffer, uint64_t buffer_size,
   while (send_end < receive_end) {
     int sent = send_pkt(buffer, send_end, receive_end - send_end,
                         dev_dst_result->tx_queue[idx]);
+    if (sent) {
+      mark_tx_queue(dev_dst_result, idx);
+    }
     send_end += sent;
     idx++;
   }
+  return receive_end;
 }
 
 void simple_forward(int fd, struct bind_dev_result *dev1_result,
@@ -36,22 +40,39 @@ void simple_forward(int fd, struct bind_dev_result *dev1_result,
   assert(dev1_result->tx_queue_num == dev2_result->tx_queue_num);
 
   // Allocate buffer (no free, buffer will be free when progrom exit)
-  uint32_t buffer_size = dev1_result->rx_queue[0]->nentries;
+  uint32_t buffer_size = 0;
+  for (uint64_t i = 0; i < dev1_result->rx_queue_num && !buffer_size; i++) {
+    if (dev1_result->rx_queue[i]) {
+      buffer_size = dev1_result->rx_queue[i]->nentries;
+    }
+  }
+  assert(buffer_size);
   buffer_size = buffer_size * dev1_result->rx_queue_num * 2;
   uint64_t *buffer = (uint64_t *)malloc(buffer_size);
   assert(buffer);
   printf("buffser size: %u\n", buffer_size);
 
+  uint32_t idle_rounds = 0;
   while (1) {
-    forward_once(buffer, buffer_size, dev1_result, dev2_result);
-    forward_once(buffer, buffer_size, dev2_result, dev1_result);
-    ioctl(fd, IOCTL_SEND_ALL, 0);
+    uint64_t received = 0;
+    received += forward_once(buffer, buffer_size, dev1_result, dev2_result);
+    received += forward_once(buffer, buffer_size, dev2_result, dev1_result);
+    if (received) {
+      ioctl(fd, IOCTL_SEND_ALL, 0);
+      idle_rounds = 0;
+    } else if (++idle_rounds >= IDLE_SPIN_ROUNDS) {
+      wait_pkt(fd, -1);
+      idle_rounds = 0;
+      // Pick up rx queues of cpus that came online
+      refresh_rx_queues(dev1_result);
+      refresh_rx_queues(dev2_result);
+    }
   }
 }
 
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
-    printf("Usage: %s <dev1_name> <dev2_name>\n", argv[0]);
+  if (argc != 3 && argc != 4) {
+    printf("Usage: %s <dev1_name> <dev2_name> [ring_depth]\n", argv[0]);
     exit(EXIT_FAILURE);
   }
 
@@ -62,10 +83,16 @@ int main(int argc, char *argv[]) {
     exit(EXIT_FAILURE);
   }
 
-  struct bind_dev_info dev1_info;
-  struct bind_dev_info dev2_info;
+  // Zeroed geometry requests the default queue number and ring depth
+  struct bind_dev_info dev1_info = {0};
+  struct bind_dev_info dev2_info = {0};
   strcpy(dev1_info.dev_name, argv[1]);
   strcpy(dev2_info.dev_name, argv[2]);
+  if (argc == 4) {
+    unsigned long ring_depth = strtoul(argv[3], NULL, 0);
+    dev1_info.rx_ring_depth = dev1_info.tx_ring_depth = ring_depth;
+    dev2_info.rx_ring_depth = dev2_info.tx_ring_depth = ring_depth;
+  }
 
   printf("bind dev1: %s\n", dev1_info.dev_name);
   printf("bind dev2: %s\n", dev2_info.dev_name);
@@ -4,9 +4,13 @@
 #include "../common_config.h"
 #include "user_queue.h"
 #include <assert.h>
+#include <poll.h>
+#include <sched.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <stdlib.h>
@@ -18,9 +22,29 @@ static void copy_dev_info(struct bind_dev_info *dst, struct bind_dev_info *src)
   dst->rx_start_offset = src->rx_start_offset;
   dst->rx_queue_num = src->rx_queue_num;
   dst->rx_queue_size = src->rx_queue_size;
+  dst->rx_ring_depth = src->rx_ring_depth;
   dst->tx_start_offset = src->tx_start_offset;
   dst->tx_queue_num = src->tx_queue_num;
   dst->tx_queue_size = src->tx_queue_size;
+  dst->tx_ring_depth = src->tx_ring_depth;
+  dst->rx_desc_format = src->rx_desc_format;
+  dst->rx_desc_size = src->rx_desc_size;
+  dst->tx_desc_format = src->tx_desc_format;
+  dst->tx_desc_size = src->tx_desc_size;
+  dst->rx_frame_size = src->rx_frame_size;
+  dst->rx_frame_start_offset = src->rx_frame_start_offset;
+  dst->rx_frame_area_size = src->rx_frame_area_size;
+  dst->stats_offset = src->stats_offset;
+  dst->stats_size = src->stats_size;
+  dst->flags = src->flags;
+  dst->tx_dirty_offset = src->tx_dirty_offset;
+  dst->tx_dirty_size = src->tx_dirty_size;
+  dst->tx_comp_start_offset = src->tx_comp_start_offset;
+  dst->tx_comp_size = src->tx_comp_size;
+  dst->rx_group = src->rx_group;
+  dst->desc_version = src->desc_version;
+  dst->region_offset = src->region_offset;
+  dst->region = src->region;
 }
 
 #define PRINT_BIND_DEV_INFO(print, info)                                       \
@@ -29,17 +53,49 @@ static void copy_dev_info(struct bind_dev_info *dst, struct bind_dev_info *src)
   print("  RX Start Offset: %lu\n", info->rx_start_offset);                    \
   print("  RX Queue Number: %lu\n", info->rx_queue_num);                       \
   print("  RX Queue Size: %lu\n", info->rx_queue_size);                        \
+  print("  RX Ring Depth: %lu\n", info->rx_ring_depth);                        \
   print("  TX Start Offset: %lu\n", info->tx_start_offset);                    \
   print("  TX Queue Number: %lu\n", info->tx_queue_num);                       \
-  print("  TX Queue Size: %lu\n", info->tx_queue_size);
+  print("  TX Queue Size: %lu\n", info->tx_queue_size);                        \
+  print("  TX Ring Depth: %lu\n", info->tx_ring_depth);                        \
+  print("  RX Desc Format: %lu\n", info->rx_desc_format);                      \
+  print("  RX Desc Size: %lu\n", info->rx_desc_size);                          \
+  print("  TX Desc Format: %lu\n", info->tx_desc_format);                      \
+  print("  TX Desc Size: %lu\n", info->tx_desc_size);                          \
+  print("  RX Frame Size: %lu\n", info->rx_frame_size);                        \
+  print("  RX Frame Start Offset: %lu\n", info->rx_frame_start_offset);        \
+  print("  RX Frame Area Size: %lu\n", info->rx_frame_area_size);              \
+  print("  Stats Offset: %lu\n", info->stats_offset);                          \
+  print("  Stats Size: %lu\n", info->stats_size);                          \
+  print("  Flags: %lu\n", info->flags);                                        \
+  print("  TX Dirty Offset: %lu\n", info->tx_dirty_offset);                    \
+  print("  TX Dirty Size: %lu\n", info->tx_dirty_size);                        \
+  print("  TX Comp Start Offset: %lu\n", info->tx_comp_start_offset);          \
+  print("  TX Comp Size: %lu\n", info->tx_comp_size);                          \
+  print("  RX Group: %lu\n", info->rx_group);                                  \
+  print("  Desc Version: %lu\n", info->desc_version);                          \
+  print("  Region Offset: %lu\n", info->region_offset);                        \
+  print("  Region Size: %lu\n", (unsigned long)info->region.size);
 
 struct bind_dev_result {
   int success;
   struct bind_dev_info dev_info;
+  // Every part of the binding, mapped at once, see bind_dev_info.region
+  uint8_t *region;
   struct xsp_queue **rx_queue;
+  // Frame area of each rx queue, NULL without header windows
+  uint8_t **rx_frames;
   uint64_t rx_queue_num;
   struct xsp_queue **tx_queue;
   uint64_t tx_queue_num;
+  const struct xsp_stats_region *stats;
+  // stats->layout_gen the rx queues were mapped at
+  uint64_t layout_gen;
+  // NULL unless bound with XSP_BIND_TX_DIRTY
+  struct xsp_tx_dirty *tx_dirty;
+  // Completion ring of each tx queue, NULL unless bound with
+  // XSP_BIND_TX_COMPLETION
+  struct xsp_queue **tx_comp;
 };
 
 static void print_bind_dev_result(struct bind_dev_result *result) {
@@ -49,14 +105,131 @@ static void print_bind_dev_result(struct bind_dev_result *result) {
   printf("rx_queue_num: %lu\n", result->rx_queue_num);
   assert(result->rx_queue);
   for (uint64_t i = 0; i < result->rx_queue_num; i++) {
-    printf("  tx_queue[%lu](nentry: %u)\n", i, result->tx_queue[i]->nentries);
+    // Slots of offline cpus have no queue
+    if (result->rx_queue[i]) {
+      printf("  rx_queue[%lu](nentry: %u cpu: %d node: %u)\n", i,
+             result->rx_queue[i]->nentries, (int)result->stats->queues[i].cpu,
+             result->stats->queues[i].node);
+    }
   }
 
   printf("tx_queue_num: %lu\n", result->tx_queue_num);
   assert(result->tx_queue);
   for (uint64_t i = 0; i < result->tx_queue_num; i++) {
-    printf("  tx_queue[%lu](nentry: %u)\n", i, result->tx_queue[i]->nentries);
+    printf("  tx_queue[%lu](nentry: %u node: %u)\n", i,
+           result->tx_queue[i]->nentries,
+           result->stats->queues[result->rx_queue_num + i].node);
+  }
+}
+
+/// Collect the cpus of NUMA node node into cpus, as reported by the per cpu
+/// rx queue slots of a bound device. Returns the number of cpus found, 0 if
+/// the rx queues of the device are shared.
+static int node_cpus(const struct bind_dev_result *result, uint32_t node,
+                     cpu_set_t *cpus) {
+  int num = 0;
+
+  CPU_ZERO(cpus);
+  for (uint64_t i = 0; i < result->rx_queue_num; i++) {
+    const struct xsp_queue_stats *q = &result->stats->queues[i];
+    if (q->cpu != XSP_QUEUE_NO_CPU && q->cpu < CPU_SETSIZE && q->node == node) {
+      CPU_SET(q->cpu, cpus);
+      num++;
+    }
+  }
+  return num;
+}
+
+/// Set up the rx queue of slot i if it exists and is not set up yet. Queues
+/// of cpus that came online after the region was mapped are mapped by the
+/// kernel when they are first touched.
+static int map_rx_queue(struct bind_dev_result *result, uint64_t i) {
+  const struct xsp_region_layout *layout = &result->dev_info.region;
+
+  if (result->rx_queue[i] ||
+      result->stats->queues[i].state == XSP_QUEUE_ABSENT) {
+    return 0;
+  }
+  struct xsp_queue *queue = (struct xsp_queue *)malloc(sizeof(struct xsp_queue));
+  if (!queue) {
+    perror("Failed to malloc rx_queue");
+    return -1;
+  }
+  uint8_t *ring = result->region + layout->rx_queues + i * layout->rx_queue_stride;
+  init_xsp_queue(queue, (struct xsp_ring_buffer *)ring);
+  if (result->rx_frames) {
+    result->rx_frames[i] =
+        result->region + layout->rx_frames + i * layout->rx_frame_stride;
+  }
+  result->rx_queue[i] = queue;
+  return 0;
+}
+
+/// Hand the descriptors submitted to tx queue i to the kernel. Devices bound
+/// with XSP_BIND_TX_POLL are drained by a kernel thread, which only needs a
+/// kick once it went idle.
+static inline void send_tx_queue(int fd, const struct bind_dev_result *result,
+                                 uint64_t i) {
+  const struct bind_dev_info *dev_info = &result->dev_info;
+
+  if (dev_info->flags & XSP_BIND_TX_POLL) {
+    /* Pairs with the barrier of the poller between setting the flag and
+     * checking the ring once more.
+     */
+    smp_mb();
+    if (!xsp_ring__needs_wakeup(result->tx_queue[i]))
+      return;
+  }
+  ioctl(fd, IOCTL_SEND, dev_info->tx_start_offset + i * dev_info->step);
+}
+
+/// Mark tx queue i as having new descriptors for IOCTL_SEND_ALL, needed
+/// after submitting when bound with XSP_BIND_TX_DIRTY.
+static inline void mark_tx_queue(struct bind_dev_result *result, uint64_t i) {
+  struct xsp_tx_dirty *dirty = result->tx_dirty;
+
+  if (!dirty)
+    return;
+  __atomic_fetch_or(&dirty->words[i / 64], 1ULL << (i % 64), __ATOMIC_SEQ_CST);
+  __atomic_fetch_or(&dirty->summary, 1ULL << (i / 64), __ATOMIC_SEQ_CST);
+}
+
+/// Hand the descriptors of several tx queues, named by their mmap offsets,
+/// to the kernel with a single syscall. counts may be NULL, otherwise it
+/// receives the descriptors read from each queue or a negative errno.
+static inline int send_tx_queues(int fd, const uint64_t *offsets,
+                                 int32_t *counts, uint64_t num) {
+  struct send_batch_info info = {
+      .num = num,
+      .offsets = (uint64_t)(uintptr_t)offsets,
+      .counts = (uint64_t)(uintptr_t)counts,
+  };
+
+  return ioctl(fd, IOCTL_SEND_BATCH, &info);
+}
+
+/// Header window of a packet received on rx queue i, it may be edited in
+/// place until the packet is sent.
+static inline uint8_t *rx_frame(const struct bind_dev_result *result,
+                                uint64_t i,
+                                const struct xsp_rx_desc_ext *desc) {
+  return result->rx_frames[i] + desc->frame_off;
+}
+
+/// Set up the rx queues of cpus that came online since the last call. Cheap
+/// enough to be called on every polling round.
+static inline int refresh_rx_queues(struct bind_dev_result *result) {
+  uint64_t layout_gen = result->stats->layout_gen;
+  if (layout_gen == result->layout_gen) {
+    return 0;
+  }
+  result->layout_gen = layout_gen;
+  for (uint64_t i = 0; i < result->rx_queue_num; i++) {
+    if (map_rx_queue(result, i) < 0) {
+      return -1;
+    }
   }
+  return 0;
 }
 
 /// Bind queue to device, use should make sure the fd is opened on "/dev/xsp".
@@ -67,6 +240,8 @@ static int bind_dev(int fd, struct bind_dev_result *result,
     perror("result or dev_info is NULL");
     return -1;
   }
+  // The descriptors are read and written with the layouts of this header
+  dev_info->desc_version = XSP_DESC_VERSION;
   if (ioctl(fd, IOCTL_BIND_DEV, dev_info) < 0) {
     perror("Failed to attach interface");
     close(fd);
@@ -80,8 +255,10 @@ static int bind_dev(int fd, struct bind_dev_result *result,
   copy_dev_info(&result->dev_info, dev_info);
   result->rx_queue_num = dev_info->rx_queue_num;
   result->tx_queue_num = dev_info->tx_queue_num;
-  result->rx_queue = (struct xsp_queue **)malloc(sizeof(struct xsp_queue *) *
-                                                 dev_info->rx_queue_num);
+  result->rx_queue = (struct xsp_queue **)calloc(dev_info->rx_queue_num,
+                                                 sizeof(struct xsp_queue *));
+  result->rx_frames = NULL;
+  result->tx_comp = NULL;
 
   result->tx_queue = (struct xsp_queue **)malloc(sizeof(struct xsp_queue *) *
                                                  dev_info->tx_queue_num);
@@ -89,36 +266,44 @@ static int bind_dev(int fd, struct bind_dev_result *result,
     perror("Failed to malloc rx_queue or tx_queue");
     goto err;
   }
+  if (dev_info->rx_frame_size) {
+    result->rx_frames =
+        (uint8_t **)calloc(dev_info->rx_queue_num, sizeof(uint8_t *));
+    if (!result->rx_frames) {
+      perror("Failed to malloc rx_frames");
+      goto err;
+    }
+  }
   printf("create queue arrray successly\n");
 
+  // A single mapping holds every ring, the stats and the tx dirty region
+  const struct xsp_region_layout *layout = &dev_info->region;
+  result->region =
+      (uint8_t *)mmap(NULL, layout->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, dev_info->region_offset);
+  if (result->region == MAP_FAILED) {
+    perror("Failed to mmap region");
+    goto err;
+  }
+
+  // The stats region tells which rx queue slots have a queue
+  result->stats = (const struct xsp_stats_region *)result->region;
+  result->layout_gen = result->stats->layout_gen;
+  result->tx_dirty = NULL;
+  if (layout->tx_dirty) {
+    result->tx_dirty = (struct xsp_tx_dirty *)(result->region + layout->tx_dirty);
+  }
   for (uint64_t i = 0; i < dev_info->rx_queue_num; i++) {
-    ring_buffer = (struct xsp_ring_buffer *)mmap(
-        NULL, dev_info->rx_queue_size, PROT_READ | PROT_WRITE,
-        MAP_SHARED | MAP_POPULATE, fd,
-        dev_info->rx_start_offset + i * dev_info->step);
-    if (ring_buffer == MAP_FAILED) {
-      perror("Failed to mmap rx ring 1");
-      goto err;
-    }
-    result->rx_queue[i] = (struct xsp_queue *)malloc(sizeof(struct xsp_queue));
-    if (!result->rx_queue[i]) {
-      perror("Failed to malloc rx_queue");
+    if (map_rx_queue(result, i) < 0) {
       // TODO free allocated xsp_queue
       goto err;
     }
-    init_xsp_queue(result->rx_queue[i], ring_buffer);
   }
   printf("rx_queue mmap successly\n");
 
   for (uint64_t i = 0; i < dev_info->tx_queue_num; i++) {
-    ring_buffer = (struct xsp_ring_buffer *)mmap(
-        NULL, dev_info->tx_queue_size, PROT_READ | PROT_WRITE,
-        MAP_SHARED | MAP_POPULATE, fd,
-        dev_info->tx_start_offset + i * dev_info->step);
-    if (ring_buffer == MAP_FAILED) {
-      perror("Failed to mmap rx ring 1");
-      goto err;
-    }
+    ring_buffer = (struct xsp_ring_buffer *)(result->region + layout->tx_queues +
+                                             i * layout->tx_queue_stride);
     result->tx_queue[i] = (struct xsp_queue *)malloc(sizeof(struct xsp_queue));
     if (!result->tx_queue[i]) {
       perror("Failed to malloc rx_queue");
@@ -129,17 +314,131 @@ static int bind_dev(int fd, struct bind_dev_result *result,
   }
   printf("tx_queue mmap successly\n");
 
+  if (layout->tx_comps) {
+    result->tx_comp = (struct xsp_queue **)calloc(dev_info->tx_queue_num,
+                                                  sizeof(struct xsp_queue *));
+    if (!result->tx_comp) {
+      perror("Failed to malloc tx_comp");
+      goto err;
+    }
+    for (uint64_t i = 0; i < dev_info->tx_queue_num; i++) {
+      ring_buffer = (struct xsp_ring_buffer *)(result->region +
+                                               layout->tx_comps +
+                                               i * layout->tx_comp_stride);
+      result->tx_comp[i] = (struct xsp_queue *)malloc(sizeof(struct xsp_queue));
+      if (!result->tx_comp[i]) {
+        perror("Failed to malloc tx_comp");
+        goto err;
+      }
+      init_xsp_queue(result->tx_comp[i], ring_buffer);
+    }
+  }
+
   return 0;
 err:
   if (result->rx_queue) {
     free(result->rx_queue);
   }
+  if (result->rx_frames) {
+    free(result->rx_frames);
+  }
   if (result->tx_queue) {
     free(result->tx_queue);
   }
+  if (result->tx_comp) {
+    free(result->tx_comp);
+  }
   return -1;
 }
 
+/// Unmap what bind_dev() mapped and unbind the device, which frees its queues
+/// in the kernel. Handles of its rx queues are no longer valid.
+static int unbind_dev(int fd, struct bind_dev_result *result) {
+  struct bind_dev_info *dev_info = &result->dev_info;
+  struct unbind_dev_info info;
+
+  for (uint64_t i = 0; i < result->rx_queue_num; i++) {
+    free(result->rx_queue[i]);
+  }
+  for (uint64_t i = 0; i < result->tx_queue_num; i++) {
+    free(result->tx_queue[i]);
+    if (result->tx_comp) {
+      free(result->tx_comp[i]);
+    }
+  }
+  munmap(result->region, dev_info->region.size);
+  free(result->rx_queue);
+  free(result->rx_frames);
+  free(result->tx_queue);
+  free(result->tx_comp);
+  result->success = 0;
+
+  memset(&info, 0, sizeof(info));
+  strncpy(info.dev_name, dev_info->dev_name, sizeof(info.dev_name) - 1);
+  return ioctl(fd, IOCTL_UNBIND_DEV, &info);
+}
+
+/// Print the counters of every queue of a bound device. The stats region is
+/// updated by the kernel in place, no syscall is needed to read it.
+static void print_dev_stats(const struct bind_dev_result *result) {
+  const struct xsp_stats_region *stats = result->stats;
+  uint64_t queue_num = stats->rx_queue_num + stats->tx_queue_num;
+
+  printf("dev: %s\n", result->dev_info.dev_name);
+  for (uint64_t i = 0; i < queue_num; i++) {
+    const struct xsp_queue_stats *q = &stats->queues[i];
+    int is_rx = i < stats->rx_queue_num;
+    uint64_t idx = is_rx ? i : i - stats->rx_queue_num;
+    if (!q->packets && !q->ring_full_drops && !q->tx_busy &&
+        !q->tx_not_forwardable && !q->tx_dropped && !q->invalid_descs &&
+        !q->offloaded && !q->tx_retries) {
+      continue;
+    }
+    printf("  %s_queue[%lu] cpu: %d node: %u state: %u packets: %lu bytes: %lu "
+           "batches: %lu ring_full_drops: %lu tx_busy: %lu "
+           "tx_not_forwardable: %lu tx_dropped: %lu invalid_descs: %lu "
+           "offloaded: %lu tx_retries: %lu completion_drops: %lu\n",
+           is_rx ? "rx" : "tx", idx, (int)q->cpu, q->node, q->state,
+           q->packets, q->bytes, q->batches,
+           q->ring_full_drops, q->tx_busy, q->tx_not_forwardable,
+           q->tx_dropped, q->invalid_descs, q->offloaded, q->tx_retries,
+           q->completion_drops);
+  }
+}
+
+/// Let the kernel forward packets received on in_dev with dst_mac (as in
+/// ring_entry.dst_mac) to out_dev directly. Both devices must be bound.
+static int add_flow(int fd, uint64_t dst_mac, const char *in_dev,
+                    const char *out_dev) {
+  struct flow_rule_info info;
+  memset(&info, 0, sizeof(info));
+  info.dst_mac = dst_mac;
+  strncpy(info.in_dev_name, in_dev, sizeof(info.in_dev_name) - 1);
+  strncpy(info.out_dev_name, out_dev, sizeof(info.out_dev_name) - 1);
+  return ioctl(fd, IOCTL_FLOW_ADD, &info);
+}
+
+static int del_flow(int fd, uint64_t dst_mac, const char *in_dev) {
+  struct flow_rule_info info;
+  memset(&info, 0, sizeof(info));
+  info.dst_mac = dst_mac;
+  strncpy(info.in_dev_name, in_dev, sizeof(info.in_dev_name) - 1);
+  return ioctl(fd, IOCTL_FLOW_DEL, &info);
+}
+
+/// Let XSP_TX_ACT_FANOUT descriptors naming group id go out of the devices
+/// with the given ifindexes, which must be bound. No devices removes the
+/// group.
+static int set_port_group(int fd, uint32_t id, const uint32_t *ifindexes,
+                          uint32_t num) {
+  struct port_group_info info;
+  memset(&info, 0, sizeof(info));
+  info.id = id;
+  info.num = num;
+  info.ifindexes = (uint64_t)(uintptr_t)ifindexes;
+  return ioctl(fd, IOCTL_PORT_GROUP_SET, &info);
+}
+
 static void print_mac_address(uint64_t mac_addr, char *prefix) {
   unsigned char mac[6];
   for (int i = 0; i < 6; i++) {
@@ -153,6 +452,10 @@ static inline int receive_pkt(uint64_t *buffer, uint64_t start_idx,
                               uint64_t max_size, struct xsp_queue *queue) {
   uint32_t idx = 0;
   int reserve = 0;
+  // Rx queue slot of an offline cpu
+  if (!queue) {
+    return 0;
+  }
   int avail_receive = xsp_cons_nb_avail(queue, max_size);
   if (avail_receive > 0) {
     reserve = xsp_ring_cons__peek(queue, avail_receive, &idx);
@@ -176,6 +479,12 @@ static inline int send_pkt(uint64_t *buffer, uint64_t start_idx,
   // }
   for (int i = 0; i < reserve; i++) {
     uint64_t addr = buffer[start_idx + i];
+    if (queue->desc_size == sizeof(struct xsp_desc_compact)) {
+      // Out of the device of the ring
+      *xsp_ring_prod__desc_compact(queue, idx + i) =
+          (struct xsp_desc_compact){.addr = addr};
+      continue;
+    }
     struct ring_entry *entry = xsp_ring_prod__fill_addr(queue, idx + i);
     entry->addr = addr;
   }
@@ -183,4 +492,54 @@ static inline int send_pkt(uint64_t *buffer, uint64_t start_idx,
   return reserve;
 }
 
+/// Number of empty polling rounds a forwarder spins before it sleeps in
+/// wait_pkt() or wait_rx_eventfd().
+#define IDLE_SPIN_ROUNDS 1024
+
+/// Sleep until any rx ring bound on fd has packets, or timeout_ms expires
+/// (-1 waits forever). Returns the poll() result. Threads that only consume
+/// some of the rings use rx_rings_need_wakeup() and wait_rx_eventfd().
+static inline int wait_pkt(int fd, int timeout_ms) {
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  return poll(&pfd, 1, timeout_ms);
+}
+
+/// Signal eventfd efd whenever the rx ring at offset has new packets for a
+/// sleeping consumer, see IOCTL_RX_EVENTFD.
+static inline int set_rx_eventfd(int fd, uint64_t offset, int efd) {
+  struct rx_eventfd_info info = {.offset = offset, .fd = efd};
+  return ioctl(fd, IOCTL_RX_EVENTFD, &info);
+}
+
+/// Mark rings with XSP_RING_NEED_WAKEUP before sleeping on their eventfd.
+/// Returns whether one of them has packets already, the caller must not
+/// sleep then.
+static inline int rx_rings_need_wakeup(struct xsp_queue **rings, uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) {
+    *(volatile uint32_t *)rings[i]->flag |= XSP_RING_NEED_WAKEUP;
+  }
+  /* Pairs with the barrier of the rx handler between publishing packets and
+   * checking the flag
+   */
+  smp_mb();
+  for (uint32_t i = 0; i < n; i++) {
+    if (xsp_cons_nb_avail(rings[i], 1)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/// Sleep until one of the rings attached to efd is signalled, or timeout_ms
+/// expires (-1 waits forever). Returns the poll() result.
+static inline int wait_rx_eventfd(int efd, int timeout_ms) {
+  struct pollfd pfd = {.fd = efd, .events = POLLIN};
+  uint64_t count;
+  int ret = poll(&pfd, 1, timeout_ms);
+  if (ret > 0 && read(efd, &count, sizeof(count)) < 0) {
+    return -1;
+  }
+  return ret;
+}
+
 #endif
@@ -1,6 +1,7 @@
 #ifndef _USER_QUEUE_H
 #define _USER_QUEUE_H
 
+#include "../common_config.h"
 #include <stdint.h>
 
 #define size_t uint64_t
@@ -10,6 +11,13 @@
 #define smp_mb() asm volatile("lock; addl $0,-4(%%rsp)" : : : "memory", "cc")
 #define smp_rwmb() asm volatile("" : : : "memory")
 
+/* Bits of xsp_ring.flag */
+
+/* The consumer is (about to go) asleep and wants the producer to wake it
+ * up once new entries are published.
+ */
+#define XSP_RING_NEED_WAKEUP (1 << 0)
+
 struct xsp_ring {
   uint32_t producer __attribute__((__aligned__((1 << (6)))));
   /* Hinder the adjacent cache prefetcher to prefetch the consumer
@@ -20,16 +28,15 @@ struct xsp_ring {
   uint32_t pad2 __attribute__((__aligned__((1 << (6)))));
   uint32_t nentries;
   uint32_t flag;
+  /* Bytes between two entries */
+  uint32_t desc_size;
   uint32_t pad3 __attribute__((__aligned__((1 << (6)))));
 };
 
-struct ring_entry {
-  uint64_t addr;
-  uint64_t src_mac;
-  uint64_t dst_mac;
-};
-
-/* Used for the fill and completion queues for buffers */
+/* Used for the fill and completion queues for buffers. Entries are one of
+ * the descriptors of XSP_DESC_FORMAT_*, all of them start with the handle
+ * of struct ring_entry.
+ */
 struct xsp_ring_buffer {
   struct xsp_ring ptrs;
   struct ring_entry addrs[] __attribute__((__aligned__((1 << (6)))));
@@ -40,8 +47,10 @@ struct xsp_queue {
   uint32_t cached_cons;
   uint32_t mask;
   uint32_t nentries;
+  uint32_t desc_size;
   uint32_t *producer;
   uint32_t *consumer;
+  uint32_t *flag;
   void *addrs;
 };
 
@@ -51,15 +60,23 @@ static void init_xsp_queue(struct xsp_queue *queue,
   queue->cached_cons = ring->ptrs.consumer;
   queue->mask = ring->ptrs.nentries - 1;
   queue->nentries = ring->ptrs.nentries;
+  queue->desc_size = ring->ptrs.desc_size;
   queue->producer = &ring->ptrs.producer;
   queue->consumer = &ring->ptrs.consumer;
+  queue->flag = &ring->ptrs.flag;
   queue->addrs = ring->addrs;
 }
 
-static inline struct ring_entry *xsp_ring_prod__fill_addr(struct xsp_queue *fill, uint32_t idx) {
-  struct ring_entry *addrs = (struct ring_entry *)fill->addrs;
+static inline int xsp_ring__needs_wakeup(const struct xsp_queue *r) {
+  return *(volatile uint32_t *)r->flag & XSP_RING_NEED_WAKEUP;
+}
 
-  return &addrs[idx & fill->mask];
+static inline void *xsp_ring__desc(const struct xsp_queue *r, uint32_t idx) {
+  return (char *)r->addrs + (uint64_t)(idx & r->mask) * r->desc_size;
+}
+
+static inline struct ring_entry *xsp_ring_prod__fill_addr(struct xsp_queue *fill, uint32_t idx) {
+  return (struct ring_entry *)xsp_ring__desc(fill, idx);
 }
 
 static inline uint32_t xsp_prod_nb_free(struct xsp_queue *r, uint32_t nb) {
@@ -99,9 +116,44 @@ static inline const struct ring_entry *xsp_ring_cons__comp_addr(const struct xsp
                                                   uint32_t idx) {
   smp_rmb();
 
-  const struct ring_entry *addrs = (const struct ring_entry *)comp->addrs;
+  return (const struct ring_entry *)xsp_ring__desc(comp, idx);
+}
+
+/* Extended descriptor of a rx ring bound with XSP_DESC_FORMAT_EXT */
+static inline const struct xsp_rx_desc_ext *
+xsp_ring_cons__rx_desc_ext(const struct xsp_queue *rx, uint32_t idx) {
+  smp_rmb();
+
+  return (const struct xsp_rx_desc_ext *)xsp_ring__desc(rx, idx);
+}
+
+/* Descriptor of a ring bound with XSP_DESC_FORMAT_COMPACT */
+static inline const struct xsp_desc_compact *
+xsp_ring_cons__desc_compact(const struct xsp_queue *rx, uint32_t idx) {
+  smp_rmb();
+
+  return (const struct xsp_desc_compact *)xsp_ring__desc(rx, idx);
+}
+
+static inline struct xsp_desc_compact *
+xsp_ring_prod__desc_compact(struct xsp_queue *tx, uint32_t idx) {
+  return (struct xsp_desc_compact *)xsp_ring__desc(tx, idx);
+}
+
+/* Rx descriptor of a ring bound with XSP_DESC_FORMAT_IF */
+static inline const struct xsp_rx_desc_if *
+xsp_ring_cons__rx_desc_if(const struct xsp_queue *rx, uint32_t idx) {
+  smp_rmb();
+
+  return (const struct xsp_rx_desc_if *)xsp_ring__desc(rx, idx);
+}
+
+/* Entry of a tx completion ring, see XSP_BIND_TX_COMPLETION */
+static inline const struct xsp_tx_completion *
+xsp_ring_cons__tx_completion(const struct xsp_queue *comp, uint32_t idx) {
+  smp_rmb();
 
-  return &addrs[idx & comp->mask];
+  return (const struct xsp_tx_completion *)xsp_ring__desc(comp, idx);
 }
 
 static inline uint32_t xsp_cons_nb_avail(struct xsp_queue *r, uint32_t nb) {
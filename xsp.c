@@ -1,275 +1,2565 @@
 #define pr_fmt(fmt) "AF_XSP: %s: " fmt, __func__
 
 #include "common_config.h"
+#include "flow_table.h"
 #include "map.h"
+#include "port_group.h"
 #include "queue_array.h"
+#include "skb_table.h"
 #include "xsp_queue.h"
 #include <linux/fs.h>
+#include <linux/cpu.h>
+#include <linux/cpuhotplug.h>
 #include <linux/if_ether.h>
+#include <linux/if_vlan.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
+#include <linux/interrupt.h>
+#include <linux/kthread.h>
 #include <linux/module.h>
 #include <linux/netdevice.h>
+#include <linux/percpu.h>
+#include <linux/poll.h>
 #include <linux/rtnetlink.h>
 #include <linux/veth.h>
+#include <linux/workqueue.h>
+#include <net/flow_dissector.h>
 
-struct queue_array_list global_queue_array_list;
-struct offset_queue_table global_offset_queue_table;
+// Bound devices of all files, a device is bound by one file at most
 struct dev_queue_table global_dev_queue_table;
+struct flow_table global_flow_table;
+
+// State of an open file of the device. Devices belong to the file they were
+// bound through: each file has its own mmap offsets, skb handles, rx groups
+// and port groups, and its devices are unbound when it is released.
+struct xsp_ctx {
+  struct offset_queue_table offsets;
+  struct queue_array_list queue_arrays;
+  // Skb tables of the rx queues and tx queues by table id, see skb_table.h
+  struct xarray skb_tables;
+  // First bound device of each rx group, see bind_dev_info.rx_group
+  struct xarray rx_groups;
+  struct port_group_table port_groups;
+  // Devices bound through this file, linked by dev_queue_entry.ctx_node
+  struct list_head devs;
+  // Keeps poll() and mmap from seeing a device being unbound
+  struct mutex lock;
+};
+static_assert(XSP_PORT_GROUP_MAX <= PORT_GROUP_TABLE_SIZE);
+
+// Serializes binding devices with cpu hotplug callbacks
+static DEFINE_MUTEX(bind_lock);
+static enum cpuhp_state xsp_cpuhp_state;
+
+// Number of packets a rx queue may hold back before its producer index is
+// published to userspace. 0 or 1 publishes every packet immediately.
+static unsigned int rx_batch_size = 64;
+module_param(rx_batch_size, uint, 0644);
+MODULE_PARM_DESC(rx_batch_size,
+                 "Max packets per rx queue publication (default 64)");
+
+// A consumer sleeping in poll() is woken up once this many packets were
+// published to one of its rx queues, or wakeup_usecs after the first one.
+static unsigned int wakeup_batch = 1;
+module_param(wakeup_batch, uint, 0644);
+MODULE_PARM_DESC(wakeup_batch,
+                 "Packets published before a sleeping consumer is woken up");
+static unsigned int wakeup_usecs = 0;
+module_param(wakeup_usecs, uint, 0644);
+MODULE_PARM_DESC(wakeup_usecs, "Max delay in usecs before a sleeping consumer "
+                               "is woken up, 0 wakes it up immediately");
+
+// A tx poller spins this long over its idle tx rings before it sleeps.
+static unsigned int tx_poll_idle_usecs = 1000;
+module_param(tx_poll_idle_usecs, uint, 0644);
+MODULE_PARM_DESC(tx_poll_idle_usecs,
+                 "Usecs a tx poller spins over idle rings before it sleeps");
+
+#define FOR_EACH_BOUND_DEV(entry)                                              \
+  list_for_each_entry_rcu(entry, &global_dev_queue_table.entries, list_node)
+
+// Devices bound through ctx, under rcu_read_lock() or ctx->lock
+#define FOR_EACH_CTX_DEV(ctx, entry)                                           \
+  list_for_each_entry_rcu(entry, &(ctx)->devs, ctx_node,                       \
+                          lockdep_is_held(&(ctx)->lock))
+
+// Wake up the consumer sleeping on a rx queue after nb new entries were
+// published.
+static void rx_queue_wakeup(struct xsp_queue *queue, u32 nb) {
+  u32 pending = queue->wakeup_pending + nb;
+  unsigned int usecs = READ_ONCE(wakeup_usecs);
+
+  if (pending >= READ_ONCE(wakeup_batch) || !usecs) {
+    hrtimer_try_to_cancel(&queue->wakeup_timer);
+    xspq_wakeup(queue);
+    return;
+  }
+  WRITE_ONCE(queue->wakeup_pending, pending);
+  if (!hrtimer_active(&queue->wakeup_timer)) {
+    hrtimer_start(&queue->wakeup_timer, us_to_ktime(usecs),
+                  HRTIMER_MODE_REL_SOFT);
+  }
+}
+
+// Rx queues shared by several cpus serialize their producers, the ones owned
+// by a single cpu need no lock. Only called from softirq context.
+static inline void rx_queue_lock(struct xsp_queue *queue) {
+  if (queue->shared_prod) {
+    spin_lock(&queue->prod_lock);
+  }
+}
+
+static inline void rx_queue_unlock(struct xsp_queue *queue) {
+  if (queue->shared_prod) {
+    spin_unlock(&queue->prod_lock);
+  }
+}
+
+// Publish every reserved entry of a rx queue to userspace, the caller holds
+// rx_queue_lock().
+static void rx_queue_submit(struct xsp_queue *queue) {
+  u32 nb = xspq_prod_nb_unpublished(queue);
+
+  if (!nb) {
+    return;
+  }
+  xspq_prod_submit(queue);
+  queue->stats->batches++;
+  // Pairs with the barrier in xspdev_poll()
+  smp_mb();
+  if (unlikely(xspq_need_wakeup(queue))) {
+    rx_queue_wakeup(queue, nb);
+  }
+}
+
+#define RX_BATCH_QUEUE_NUM 16
+
+// Rx queues written by this cpu in the current softirq cycle whose new
+// entries have not been published yet. The flush tasklet runs once the
+// NET_RX softirq is done, so every queue pays one store-release per poll
+// instead of one per packet.
+struct rx_batch {
+  struct tasklet_struct flush_tasklet;
+  // Publishes the batch from process context, see rx_batches_drain()
+  struct work_struct drain_work;
+  u32 queue_num;
+  struct xsp_queue *queue[RX_BATCH_QUEUE_NUM];
+};
+
+static DEFINE_PER_CPU(struct rx_batch, rx_batch);
+
+static void rx_batch_flush(struct rx_batch *batch) {
+  for (u32 i = 0; i < batch->queue_num; i++) {
+    rx_queue_lock(batch->queue[i]);
+    rx_queue_submit(batch->queue[i]);
+    rx_queue_unlock(batch->queue[i]);
+  }
+  batch->queue_num = 0;
+}
+
+static void rx_batch_flush_tasklet(struct tasklet_struct *t) {
+  struct rx_batch *batch = from_tasklet(batch, t, flush_tasklet);
+
+  rx_batch_flush(batch);
+}
+
+static void rx_batch_drain_fn(struct work_struct *work) {
+  struct rx_batch *batch = container_of(work, struct rx_batch, drain_work);
+
+  local_bh_disable();
+  rx_batch_flush(batch);
+  local_bh_enable();
+}
+
+// Publish the batches of all cpus, so that none of them refers to a queue
+// anymore once the rx handler of its device is unregistered. Online cpus
+// flush their own batch, the one of an offline cpu can only be pending in
+// its tasklet, which was moved to an online cpu. Called with
+// cpus_read_lock() held.
+static void rx_batches_drain(void) {
+  int cpu;
+
+  lockdep_assert_cpus_held();
+  for_each_online_cpu(cpu) {
+    queue_work_on(cpu, system_highpri_wq, &per_cpu(rx_batch, cpu).drain_work);
+  }
+  for_each_possible_cpu(cpu) {
+    if (cpu_online(cpu)) {
+      flush_work(&per_cpu(rx_batch, cpu).drain_work);
+    } else {
+      tasklet_kill(&per_cpu(rx_batch, cpu).flush_tasklet);
+    }
+  }
+}
+
+static void rx_batch_add(struct rx_batch *batch, struct xsp_queue *queue) {
+  // The queue may already be here if it was published early because it
+  // reached rx_batch_size, or by another cpu sharing it.
+  for (u32 i = 0; i < batch->queue_num; i++) {
+    if (batch->queue[i] == queue) {
+      return;
+    }
+  }
+  if (unlikely(batch->queue_num == RX_BATCH_QUEUE_NUM)) {
+    // No room to hold the queue back, publish it right away. The batch can
+    // not be flushed here, the lock of queue is held and taking the locks
+    // of other shared queues could deadlock with another cpu.
+    rx_queue_submit(queue);
+    return;
+  }
+  batch->queue[batch->queue_num++] = queue;
+  tasklet_schedule(&batch->flush_tasklet);
+}
+
+// Called after a packet is reserved in a rx queue produced by this cpu, with
+// rx_queue_lock() held.
+static inline void rx_queue_publish(struct xsp_queue *queue) {
+  u32 pending = xspq_prod_nb_unpublished(queue);
+
+  if (pending >= READ_ONCE(rx_batch_size)) {
+    rx_queue_submit(queue);
+    return;
+  }
+  if (pending == 1) {
+    rx_batch_add(this_cpu_ptr(&rx_batch), queue);
+  }
+}
+
+// Whether skb can be sent out of dev: 0 if it can, -EBUSY if the device is
+// busy and -EINVAL if the skb can not be forwarded to it.
+static inline int xmit_check(struct net_device *dev, struct sk_buff *skb) {
+  if (netpoll_tx_running(dev)) {
+    return -EBUSY;
+  }
+  if (!is_skb_forwardable(dev, skb)) {
+    return -EINVAL;
+  }
+  return 0;
+}
+
+// Transmit an skb received on a bound device out of dev. The skb is always
+// consumed. Returns 0 on success, -EBUSY if the device is busy, -EINVAL if
+// the skb can not be forwarded to it and -ENOBUFS if it was dropped.
+static inline int xmit_skb(struct net_device *dev, struct sk_buff *skb) {
+  int err = xmit_check(dev, skb);
+
+  if (err) {
+    consume_skb(skb);
+    return err;
+  }
+  skb->dev = dev;
+  skb_push(skb, ETH_HLEN);
+  // dev_queue_xmit() always consumes the skb
+  if (net_xmit_eval(dev_queue_xmit(skb))) {
+    return -ENOBUFS;
+  }
+  return 0;
+}
+
+static inline void count_xmit_error(struct xsp_queue_stats *stats, int err) {
+  switch (err) {
+  case -EBUSY:
+    stats->tx_busy++;
+    break;
+  case -EINVAL:
+    stats->tx_not_forwardable++;
+    break;
+  default:
+    stats->tx_dropped++;
+    break;
+  }
+}
+
+#define TX_BULK_DEV_NUM 16
+#define TX_BULK_FANOUT_NUM 16
+
+// Skbs going out of the same device, chained by skb->next
+struct tx_list {
+  struct net_device *dev;
+  struct sk_buff *head;
+  struct sk_buff **tail;
+};
+
+// Descriptor fanned out to the members of a port group. It is reported once
+// its last copy is done, with the status of the first copy that was not sent.
+struct tx_fanout {
+  u64 handle;
+  u32 pending;
+  u32 status;
+};
+
+// Skbs read from a tx ring by one handle_send(). They are sent per device
+// once the ring was read: a device without qdisc takes its tx lock once and
+// rings its doorbell once for the whole list (xmit_more), a device with a
+// qdisc gets them enqueued back to back and dequeues them in bulk itself.
+// Dropped skbs are freed at once as well.
+struct tx_bulk {
+  // Context of the sending device, egress devices and port groups are
+  // looked up in it
+  struct xsp_ctx *ctx;
+  struct xsp_queue_stats *stats;
+  // Completion ring of the tx queue and the table skbs of a busy device are
+  // handed back in, NULL without completion ring
+  struct xsp_queue *comp;
+  struct skb_table *retry;
+  u32 list_num;
+  struct tx_list list[TX_BULK_DEV_NUM];
+  struct sk_buff *dropped;
+  u32 fanout_num;
+  struct tx_fanout fanout[TX_BULK_FANOUT_NUM];
+};
+
+// Handle of the descriptor an skb was sent with, kept while the skb is in a
+// tx_bulk. Clear of the gso control block. Clones and segments inherit it.
+struct tx_skb_cb {
+  u64 handle;
+  // 1 + index of the tx_fanout of the skb in its tx_bulk, 0 if the skb is
+  // the only copy of its descriptor
+  u32 fanout;
+};
+
+#define TX_SKB_CB(skb) ((struct tx_skb_cb *)(skb)->cb)
+
+static inline void tx_bulk_init(struct tx_bulk *bulk, struct xsp_ctx *ctx,
+                                struct xsp_queue *queue) {
+  bulk->ctx = ctx;
+  bulk->stats = queue->stats;
+  bulk->comp = queue->comp;
+  bulk->retry = queue->comp ? queue->skb_table : NULL;
+  bulk->list_num = 0;
+  bulk->dropped = NULL;
+  bulk->fanout_num = 0;
+}
+
+// Report what became of the descriptor of handle, if the tx queue has a
+// completion ring.
+static void tx_complete(struct tx_bulk *bulk, u64 handle, u32 status,
+                        u64 new_handle) {
+  struct xsp_tx_completion *comp = NULL;
+
+  if (!bulk->comp) {
+    return;
+  }
+  comp = (struct xsp_tx_completion *)xspq_prod_reserve_desc(bulk->comp);
+  if (unlikely(!comp)) {
+    bulk->stats->completion_drops++;
+    return;
+  }
+  comp->handle = handle;
+  comp->new_handle = new_handle;
+  comp->status = status;
+  comp->reserved = 0;
+}
+
+// One copy of a fanned out descriptor is done.
+static void tx_fanout_put(struct tx_bulk *bulk, struct tx_fanout *fanout,
+                          u32 status) {
+  if (status != XSP_TX_STATUS_SENT && fanout->status == XSP_TX_STATUS_SENT) {
+    fanout->status = status;
+  }
+  if (!--fanout->pending) {
+    tx_complete(bulk, fanout->handle, fanout->status, 0);
+  }
+}
+
+// Report what became of an skb, cb is a copy of its control block as the skb
+// may be gone already.
+static inline void tx_skb_complete(struct tx_bulk *bulk,
+                                   const struct tx_skb_cb *cb, u32 status) {
+  if (cb->fanout) {
+    tx_fanout_put(bulk, &bulk->fanout[cb->fanout - 1], status);
+  } else {
+    tx_complete(bulk, cb->handle, status, 0);
+  }
+}
+
+static inline void tx_bulk_drop(struct tx_bulk *bulk, struct sk_buff *skb) {
+  skb->next = bulk->dropped;
+  bulk->dropped = skb;
+}
+
+// Drop skb and report status for it.
+static inline void tx_bulk_fail(struct tx_bulk *bulk, struct sk_buff *skb,
+                                u32 status) {
+  tx_skb_complete(bulk, TX_SKB_CB(skb), status);
+  tx_bulk_drop(bulk, skb);
+}
+
+// The device of skb is busy, hand it back to userspace under a new handle so
+// that it can be sent again. It is dropped if the tx queue has no completion
+// ring or no room left, or if it is a copy of a fanned out descriptor.
+// skb->data is at the mac header.
+static void tx_bulk_retry(struct tx_bulk *bulk, struct sk_buff *skb) {
+  u64 handle = TX_SKB_CB(skb)->handle;
+
+  if (bulk->retry && !TX_SKB_CB(skb)->fanout &&
+      xspq_prod_nb_free(bulk->comp, 1)) {
+    skb_mark_not_on_list(skb);
+    // Descriptors name skbs whose data is past the ethernet header
+    __skb_pull(skb, ETH_HLEN);
+    u64 new_handle = skb_table_alloc(bulk->retry, skb);
+    if (new_handle) {
+      bulk->stats->tx_retries++;
+      tx_complete(bulk, handle, XSP_TX_STATUS_RETRY, new_handle);
+      return;
+    }
+    skb_push(skb, ETH_HLEN);
+  }
+  bulk->stats->tx_busy++;
+  tx_bulk_fail(bulk, skb, XSP_TX_STATUS_BUSY);
+}
+
+// Send a list through the qdisc of its device.
+static void tx_list_xmit_queued(struct tx_bulk *bulk, struct sk_buff *skb) {
+  struct xsp_queue_stats *stats = bulk->stats;
+
+  while (skb) {
+    struct sk_buff *next = skb->next;
+    unsigned int len = skb->len;
+    struct tx_skb_cb cb = *TX_SKB_CB(skb);
+
+    skb_mark_not_on_list(skb);
+    // dev_queue_xmit() always consumes the skb
+    if (net_xmit_eval(dev_queue_xmit(skb))) {
+      stats->tx_dropped++;
+      tx_skb_complete(bulk, &cb, XSP_TX_STATUS_DROPPED);
+    } else {
+      stats->packets++;
+      stats->bytes += len;
+      tx_skb_complete(bulk, &cb, XSP_TX_STATUS_SENT);
+    }
+    skb = next;
+  }
+}
+
+// Whether packets of dev must go through dev_queue_xmit(), which runs the
+// packet taps, the tc and netfilter egress hooks and the netprio map.
+static inline bool xmit_needs_stack(struct net_device *dev) {
+  if (dev_nit_active(dev)) {
+    return true;
+  }
+#ifdef CONFIG_NET_XGRESS
+  if (rcu_access_pointer(dev->tcx_egress)) {
+    return true;
+  }
+#endif
+#ifdef CONFIG_NETFILTER_EGRESS
+  if (rcu_access_pointer(dev->nf_hooks_egress)) {
+    return true;
+  }
+#endif
+#ifdef CONFIG_CGROUP_NET_PRIO
+  if (rcu_access_pointer(dev->priomap)) {
+    return true;
+  }
+#endif
+  return false;
+}
+
+// Segment and checksum what the device can not offload, skb by skb so that
+// the ones dropped on the way are reported.
+static struct sk_buff *tx_list_validate(struct tx_bulk *bulk,
+                                        struct net_device *dev,
+                                        struct sk_buff *skb) {
+  struct sk_buff *head = NULL;
+  struct sk_buff **tail = &head;
+
+  while (skb) {
+    struct sk_buff *next = skb->next;
+    struct tx_skb_cb cb = *TX_SKB_CB(skb);
+    bool again = false;
+
+    skb_mark_not_on_list(skb);
+    skb = validate_xmit_skb_list(skb, dev, &again);
+    if (!skb) {
+      // again is set if the stack took the skb over to send it later
+      bulk->stats->tx_dropped += !again;
+      tx_skb_complete(bulk, &cb,
+                      again ? XSP_TX_STATUS_SENT : XSP_TX_STATUS_DROPPED);
+    }
+    // Segments complete one by one, a fanned out descriptor waits for all
+    for (u32 segs = 0; skb; skb = skb->next, segs++) {
+      if (segs && cb.fanout) {
+        bulk->fanout[cb.fanout - 1].pending++;
+      }
+      *tail = skb;
+      tail = &skb->next;
+    }
+    skb = next;
+  }
+  return head;
+}
+
+// Hand a list straight to the driver of a device without qdisc, the
+// doorbell is only rung for the last skb. Called with bh disabled.
+static void tx_list_xmit_direct(struct tx_bulk *bulk, struct net_device *dev,
+                                struct netdev_queue *txq,
+                                struct sk_buff *skb) {
+  struct xsp_queue_stats *stats = bulk->stats;
+
+  skb = tx_list_validate(bulk, dev, skb);
+
+  HARD_TX_LOCK(dev, txq, smp_processor_id());
+  while (skb && !netif_xmit_frozen_or_drv_stopped(txq)) {
+    struct sk_buff *next = skb->next;
+    unsigned int len = skb->len;
+    struct tx_skb_cb cb = *TX_SKB_CB(skb);
+
+    skb_mark_not_on_list(skb);
+    netdev_tx_t rc = netdev_start_xmit(skb, dev, txq, next != NULL);
+    if (unlikely(!dev_xmit_complete(rc))) {
+      skb->next = next;
+      break;
+    }
+    if (rc == NETDEV_TX_OK) {
+      stats->packets++;
+      stats->bytes += len;
+      tx_skb_complete(bulk, &cb, XSP_TX_STATUS_SENT);
+    } else {
+      stats->tx_dropped++;
+      tx_skb_complete(bulk, &cb, XSP_TX_STATUS_DROPPED);
+    }
+    skb = next;
+  }
+  HARD_TX_UNLOCK(dev, txq);
+
+  // The device stopped its queue, hand back or drop what is left
+  while (skb) {
+    struct sk_buff *next = skb->next;
+
+    tx_bulk_retry(bulk, skb);
+    skb = next;
+  }
+}
+
+static void tx_list_flush(struct tx_bulk *bulk, struct tx_list *list) {
+  struct net_device *dev = list->dev;
+  struct sk_buff *skb = list->head;
+  struct netdev_queue *txq = NULL;
+
+  list->head = NULL;
+  list->tail = &list->head;
+  if (!skb) {
+    return;
+  }
+
+  rcu_read_lock_bh();
+  // The whole list goes to the tx queue of its first skb, which keeps the
+  // packets of a ring in order. Only devices without qdisc and egress hooks
+  // skip the stack.
+  txq = netdev_core_pick_tx(dev, skb, NULL);
+  if (rcu_dereference_bh(txq->qdisc)->enqueue || xmit_needs_stack(dev) ||
+      !netif_running(dev) || !netif_carrier_ok(dev)) {
+    rcu_read_unlock_bh();
+    tx_list_xmit_queued(bulk, skb);
+    return;
+  }
+  for (struct sk_buff *p = skb->next; p; p = p->next) {
+    skb_set_queue_mapping(p, skb_get_queue_mapping(skb));
+  }
+  tx_list_xmit_direct(bulk, dev, txq, skb);
+  rcu_read_unlock_bh();
+}
+
+static void tx_bulk_flush(struct tx_bulk *bulk) {
+  for (u32 i = 0; i < bulk->list_num; i++) {
+    tx_list_flush(bulk, &bulk->list[i]);
+  }
+  bulk->list_num = 0;
+  kfree_skb_list(bulk->dropped);
+  bulk->dropped = NULL;
+}
+
+static void tx_bulk_add(struct tx_bulk *bulk, struct net_device *dev,
+                        struct sk_buff *skb);
+
+// Device of ifindex bound in the context of the bulk, NULL if there is none.
+// The devices of the bulk serve as a cache, packets of a ring mostly go to a
+// few devices.
+static struct net_device *tx_bulk_resolve(struct tx_bulk *bulk, u32 ifindex) {
+  struct dev_queue_entry *entry = NULL;
+  struct net_device *dev = NULL;
+
+  for (u32 i = 0; i < bulk->list_num; i++) {
+    if (bulk->list[i].dev->ifindex == ifindex) {
+      return bulk->list[i].dev;
+    }
+  }
+  // Bound devices are held until they are unbound, which waits for the rcu
+  // read side critical section of the sender
+  rcu_read_lock();
+  entry = dev_queue_table_lookup_index(&global_dev_queue_table, ifindex);
+  dev = entry && entry->ctx == bulk->ctx ? entry->dev : NULL;
+  rcu_read_unlock();
+  return dev;
+}
+
+// Queue a clone of skb per member of a port group, except the device skb was
+// received on. The last member gets skb itself. The descriptor is reported
+// once, by the last of its copies.
+static void tx_bulk_fanout(struct tx_bulk *bulk, u32 group_id,
+                           struct sk_buff *skb) {
+  struct net_device *last = NULL;
+  struct port_group *group = NULL;
+  struct tx_fanout *fanout = NULL;
+
+  if (unlikely(bulk->fanout_num == TX_BULK_FANOUT_NUM)) {
+    // The copies of the earlier descriptors all complete in the flush
+    tx_bulk_flush(bulk);
+    bulk->fanout_num = 0;
+  }
+  fanout = &bulk->fanout[bulk->fanout_num++];
+  fanout->handle = TX_SKB_CB(skb)->handle;
+  fanout->status = XSP_TX_STATUS_SENT;
+  // Held until every copy is queued, flushes meanwhile must not report the
+  // descriptor early
+  fanout->pending = 1;
+  TX_SKB_CB(skb)->fanout = bulk->fanout_num;
+
+  rcu_read_lock();
+  group = port_group_table_lookup(&bulk->ctx->port_groups, group_id);
+  for (u32 i = 0; group && i < group->num; i++) {
+    struct net_device *dev = READ_ONCE(group->devs[i]);
+    if (!dev || dev->ifindex == skb->skb_iif) {
+      continue;
+    }
+    if (last) {
+      struct sk_buff *clone = skb_clone(skb, GFP_ATOMIC);
+      if (unlikely(!clone)) {
+        bulk->stats->tx_dropped++;
+        if (fanout->status == XSP_TX_STATUS_SENT) {
+          fanout->status = XSP_TX_STATUS_DROPPED;
+        }
+        continue;
+      }
+      fanout->pending++;
+      tx_bulk_add(bulk, last, clone);
+    }
+    last = dev;
+  }
+  rcu_read_unlock();
+
+  fanout->pending++;
+  if (!last) {
+    bulk->stats->tx_dropped++;
+    tx_bulk_fail(bulk, skb, XSP_TX_STATUS_DROPPED);
+  } else {
+    tx_bulk_add(bulk, last, skb);
+  }
+  tx_fanout_put(bulk, fanout, XSP_TX_STATUS_SENT);
+}
+
+// Queue skb to be sent out of dev by tx_bulk_flush(). The skb is dropped if
+// dev can not take it.
+static void tx_bulk_add(struct tx_bulk *bulk, struct net_device *dev,
+                        struct sk_buff *skb) {
+  struct tx_list *list = NULL;
+  int err = xmit_check(dev, skb);
+
+  if (err == -EBUSY) {
+    skb_push(skb, ETH_HLEN);
+    tx_bulk_retry(bulk, skb);
+    return;
+  }
+  if (err) {
+    count_xmit_error(bulk->stats, err);
+    tx_bulk_fail(bulk, skb, XSP_TX_STATUS_NOT_FORWARDABLE);
+    return;
+  }
+  skb->dev = dev;
+  skb_push(skb, ETH_HLEN);
+  skb_reset_mac_header(skb);
+
+  for (u32 i = 0; i < bulk->list_num; i++) {
+    if (bulk->list[i].dev == dev) {
+      list = &bulk->list[i];
+      break;
+    }
+  }
+  if (!list) {
+    if (unlikely(bulk->list_num == TX_BULK_DEV_NUM)) {
+      tx_bulk_flush(bulk);
+    }
+    list = &bulk->list[bulk->list_num++];
+    list->dev = dev;
+    list->head = NULL;
+    list->tail = &list->head;
+  }
+  skb->next = NULL;
+  *list->tail = skb;
+  list->tail = &skb->next;
+}
+
+// Fill the metadata of an extended rx descriptor. It comes from the skb
+// fields and the headers the rx handler just looked at, so userspace can
+// make its decisions without another look at the packet.
+static void rx_desc_ext_fill(struct xsp_rx_desc_ext *desc,
+                             struct sk_buff *skb) {
+  struct flow_keys keys;
+  struct vlan_hdr vhdr;
+  const struct vlan_hdr *vh;
+  u8 flags = 0;
+
+  desc->tstamp = ktime_get_real_ns();
+  desc->len = skb->mac_len + skb->len;
+
+  skb_flow_dissect_flow_keys(skb, &keys, 0);
+  desc->protocol = keys.basic.n_proto;
+  desc->l4_proto = keys.basic.ip_proto;
+  desc->saddr = 0;
+  desc->daddr = 0;
+  if (keys.control.addr_type == FLOW_DISSECTOR_KEY_IPV4_ADDRS) {
+    desc->saddr = keys.addrs.v4addrs.src;
+    desc->daddr = keys.addrs.v4addrs.dst;
+    flags |= XSP_DESC_F_IPV4;
+  } else if (keys.control.addr_type == FLOW_DISSECTOR_KEY_IPV6_ADDRS) {
+    flags |= XSP_DESC_F_IPV6;
+  }
+  desc->sport = keys.ports.src;
+  desc->dport = keys.ports.dst;
+  if (keys.ports.ports) {
+    flags |= XSP_DESC_F_PORTS;
+  }
+
+  // Prefer the hash of the device, it is free
+  desc->hash = skb_get_hash_raw(skb);
+  if (desc->hash) {
+    flags |= skb->l4_hash ? XSP_DESC_F_L4_HASH : 0;
+  } else {
+    desc->hash = flow_hash_from_keys(&keys);
+    flags |= flow_keys_have_l4(&keys) ? XSP_DESC_F_L4_HASH : 0;
+  }
+
+  desc->vlan_tci = 0;
+  if (skb_vlan_tag_present(skb)) {
+    desc->vlan_tci = skb_vlan_tag_get(skb);
+    flags |= XSP_DESC_F_VLAN;
+  } else if (eth_type_vlan(skb->protocol)) {
+    vh = skb_header_pointer(skb, 0, sizeof(vhdr), &vhdr);
+    if (vh) {
+      desc->vlan_tci = ntohs(vh->h_vlan_TCI);
+      flags |= XSP_DESC_F_VLAN;
+    }
+  }
+
+  desc->flags = flags;
+  desc->frame_len = 0;
+  desc->frame_off = 0;
+}
+
+// Copy the head of skb, from the ethernet header on, into the header window
+// of its slot in the frame area of table.
+static inline void rx_frame_fill(struct xsp_rx_desc_ext *desc,
+                                 struct skb_table *table, u64 handle,
+                                 struct sk_buff *skb) {
+  u32 slot = skb_table_handle_slot(handle);
+  void *frame = skb_table_frame(table, slot);
+  u32 len = min_t(u32, ETH_HLEN + skb->len, table->frame_size);
+
+  memcpy(frame, eth_hdr(skb), ETH_HLEN);
+  if (skb_copy_bits(skb, 0, frame + ETH_HLEN, len - ETH_HLEN)) {
+    len = ETH_HLEN;
+  }
+  table->slots[slot].frame_len = len;
+  desc->frame_len = len;
+  desc->frame_off = skb_table_frame_offset(table, slot);
+}
+
+// Write the header window of skb, maybe edited by userspace, back into the
+// packet. skb->data is past the ethernet header.
+static inline int tx_frame_store(struct sk_buff *skb, const void *frame,
+                                 u32 len) {
+  int err;
+
+  skb_push(skb, ETH_HLEN);
+  err = skb_ensure_writable(skb, len);
+  if (!err) {
+    memcpy(skb->data, frame, len);
+    // The checksum of the received packet does not cover the edits
+    skb_forward_csum(skb);
+  }
+  __skb_pull(skb, ETH_HLEN);
+  return err;
+}
+
+// Park skb in the skb table of the queue and reserve a rx descriptor of the
+// format of the queue for its handle, with rx_queue_lock() held. Returns
+// -ENOSPC if the ring is full and -ENOBUFS if the table is.
+static inline int rx_queue_reserve(struct xsp_queue *queue,
+                                   struct sk_buff *skb, u64 src_mac,
+                                   u64 dst_mac) {
+  struct xsp_rx_desc_ext *desc = NULL;
+  u64 handle;
+
+  if (xspq_prod_is_full(queue)) {
+    return -ENOSPC;
+  }
+  handle = skb_table_alloc(queue->skb_table, skb);
+  if (unlikely(!handle)) {
+    return -ENOBUFS;
+  }
+
+  if (queue->desc_size == sizeof(struct xsp_desc_compact)) {
+    struct xsp_desc_compact *compact = xspq_prod_reserve_desc(queue);
+    compact->addr = handle;
+    compact->ifindex = skb->skb_iif;
+    compact->hash = skb_get_hash(skb);
+    return 0;
+  }
+  if (queue->desc_size == sizeof(struct xsp_rx_desc_if)) {
+    struct xsp_rx_desc_if *desc_if = xspq_prod_reserve_desc(queue);
+    desc_if->addr = handle;
+    desc_if->src_mac = src_mac;
+    desc_if->dst_mac = dst_mac;
+    desc_if->ifindex = skb->skb_iif;
+    desc_if->len = skb->mac_len + skb->len;
+    return 0;
+  }
+  if (queue->desc_size != sizeof(*desc)) {
+    return xspq_prod_reserve_addr(queue, handle, src_mac, dst_mac);
+  }
+  desc = xspq_prod_reserve_desc(queue);
+  desc->addr = handle;
+  desc->src_mac = src_mac;
+  desc->dst_mac = dst_mac;
+  rx_desc_ext_fill(desc, skb);
+  if (queue->skb_table->frames) {
+    rx_frame_fill(desc, queue->skb_table, handle, skb);
+  }
+  return 0;
+}
 
 static rx_handler_result_t xsp_handle_frame(struct sk_buff **pskb) {
   struct sk_buff *skb = *pskb;
   struct queue_array *rx_queue_array = NULL;
   struct net_device *dev = skb->dev;
 
-  // todo:
-  // do we relly need this?
-  if (dev_queue_table_lookup(&global_dev_queue_table, skb->dev) == NULL) {
-    pr_warn("pass none found dev skb");
-    return RX_HANDLER_PASS;
+  // Try to get rx_queue from dev->rx_handler_data. The handler is only
+  // registered on bound devices, so it needs no lookup of the bound device.
+  // If not set, return RX_HANDLER_PASS.
+  void *data = rcu_dereference(dev->rx_handler_data);
+  if (!data) {
+    pr_warn("rx_queue_array not set in this dev, pass\n");
+    return RX_HANDLER_PASS;
+  }
+
+  // Get queue using the cpu id, the queue of a cpu that just came online
+  // may not be set up yet. Devices bound with less rx queues than cpus
+  // share them.
+  rx_queue_array = (struct queue_array *)data;
+  u32 cpu = smp_processor_id();
+  if (unlikely(cpu >= rx_queue_array->size)) {
+    cpu %= rx_queue_array->size;
+  }
+  struct xsp_queue *queue = READ_ONCE(rx_queue_array->queue[cpu]);
+  if (unlikely(!queue)) {
+    kfree_skb(skb);
+    return RX_HANDLER_CONSUMED;
+  }
+
+  skb = skb_share_check(skb, GFP_ATOMIC);
+  if (!skb) {
+    pr_warn("fail to share check skb");
+    return RX_HANDLER_CONSUMED;
+  }
+
+  u64 src_mac = 0;
+  u64 dst_mac = 0;
+
+  if (unlikely(!pskb_may_pull(skb, sizeof(struct ethhdr)))) {
+    pr_warn("skb does not contain a complete ethernet header, pass\n");
+    return RX_HANDLER_PASS;
+  }
+  struct ethhdr *eth = eth_hdr(skb);
+  memcpy(&src_mac, eth->h_source, ETH_ALEN);
+  memcpy(&dst_mac, eth->h_dest, ETH_ALEN);
+
+  // Known flows are forwarded right away without going through userspace
+  struct net_device *out_dev =
+      flow_table_lookup(&global_flow_table, dst_mac, dev);
+  if (out_dev) {
+    int err = xmit_skb(out_dev, skb);
+    rx_queue_lock(queue);
+    if (err) {
+      count_xmit_error(queue->stats, err);
+    } else {
+      queue->stats->offloaded++;
+    }
+    rx_queue_unlock(queue);
+    return RX_HANDLER_CONSUMED;
+  }
+
+  rx_queue_lock(queue);
+  int err = rx_queue_reserve(queue, skb, src_mac, dst_mac);
+  if (err) {
+    // Make sure the consumer can see what is held back in the batch,
+    // otherwise it may never drain the ring.
+    rx_queue_submit(queue);
+    if (err == -ENOSPC) {
+      queue->stats->ring_full_drops++;
+    } else {
+      queue->stats->handle_drops++;
+    }
+    consume_skb(skb);
+  } else {
+    queue->stats->packets++;
+    queue->stats->bytes += skb->mac_len + skb->len;
+    rx_queue_publish(queue);
+  }
+  rx_queue_unlock(queue);
+
+  return RX_HANDLER_CONSUMED;
+}
+
+// XSP present as a character device to the user space.
+static long xspdev_ioctl(struct file *file, unsigned int cmd,
+                         unsigned long arg);
+static int xspdev_open(struct inode *inode, struct file *file);
+static int xspdev_release(struct inode *inode, struct file *file);
+static int xspdev_mmap(struct file *filp, struct vm_area_struct *vma);
+static __poll_t xspdev_poll(struct file *file, poll_table *wait);
+static int major;
+static struct class *xspdev_class;
+static struct cdev xspdev_cdev;
+static struct file_operations xsp_fops = {
+    .owner = THIS_MODULE,
+    .unlocked_ioctl = xspdev_ioctl,
+    .open = xspdev_open,
+    .release = xspdev_release,
+    .mmap = xspdev_mmap,
+    .poll = xspdev_poll,
+};
+
+static int unbind_dev_locked(struct dev_queue_entry *entry, bool force);
+
+int xspdev_open(struct inode *inode, struct file *file) {
+  struct xsp_ctx *ctx = kvzalloc(sizeof(*ctx), GFP_KERNEL);
+
+  if (!ctx) {
+    return -ENOMEM;
+  }
+  if (offset_queue_table_init(&ctx->offsets)) {
+    kvfree(ctx);
+    return -ENOMEM;
+  }
+  queue_array_list_init(&ctx->queue_arrays);
+  xa_init_flags(&ctx->skb_tables, XA_FLAGS_ALLOC1);
+  xa_init(&ctx->rx_groups);
+  port_group_table_init(&ctx->port_groups);
+  INIT_LIST_HEAD(&ctx->devs);
+  mutex_init(&ctx->lock);
+  file->private_data = ctx;
+  pr_info("xspdev_open\n");
+  return 0;
+}
+
+// Runs once the last mapping of the file is gone as well, so the rings of
+// its devices can be freed.
+static int xspdev_release(struct inode *inode, struct file *file) {
+  struct xsp_ctx *ctx = file->private_data;
+
+  rtnl_lock();
+  cpus_read_lock();
+  mutex_lock(&bind_lock);
+  // Unbinding the first device of a rx group takes the others along, so the
+  // list is not walked
+  while (!list_empty(&ctx->devs)) {
+    unbind_dev_locked(
+        list_first_entry(&ctx->devs, struct dev_queue_entry, ctx_node), true);
+  }
+  mutex_unlock(&bind_lock);
+  cpus_read_unlock();
+  rtnl_unlock();
+
+  // Senders of the devices are done, see unbind_dev_locked()
+  port_group_table_clear(&ctx->port_groups);
+  xa_destroy(&ctx->rx_groups);
+  skb_table_registry_destroy(&ctx->skb_tables);
+  queue_array_list_destroy(&ctx->queue_arrays);
+  offset_queue_table_clear(&ctx->offsets);
+  kvfree(ctx);
+  pr_info("xspdev_release\n");
+  return 0;
+}
+
+// Parts of the region of a binding, copied out of its dev_queue_entry
+struct xsp_region_parts {
+  struct xsp_region_layout layout;
+  struct queue_array *rx_queue_array;
+  struct queue_array *tx_queue_array;
+  struct queue_array *tx_comp_array;
+  struct xsp_stats_region *stats;
+  size_t stats_size;
+  struct xsp_tx_dirty *tx_dirty;
+};
+
+// Get the parts of the binding whose region is at offset, with ctx->lock
+// held. The parts stay valid until ctx->lock is released, unbinding frees
+// them only after it took ctx->lock.
+static int xsp_region_parts_get(struct xsp_ctx *ctx, loff_t offset,
+                                struct xsp_region_parts *parts) {
+  struct offset_queue_entry *offset_entry = NULL;
+  struct dev_queue_entry *entry = NULL;
+  int ret = -EINVAL;
+
+  offset_entry = offset_queue_table_lookup(&ctx->offsets, offset);
+  if (!offset_entry || !offset_entry->binding) {
+    return -EINVAL;
+  }
+  // The entry itself is freed after a grace period once unbound, it must not
+  // be touched past rcu_read_unlock()
+  rcu_read_lock();
+  entry = dev_queue_table_lookup(&global_dev_queue_table, offset_entry->dev);
+  if (entry && entry->region.size) {
+    ret = 0;
+    parts->layout = entry->region;
+    parts->rx_queue_array = entry->rx_queue_array;
+    parts->tx_queue_array = entry->tx_queue_array;
+    parts->tx_comp_array = entry->tx_comp_array;
+    parts->stats = entry->stats;
+    parts->stats_size = entry->stats_size;
+    parts->tx_dirty = entry->tx_dirty;
+  }
+  rcu_read_unlock();
+  return ret;
+}
+
+static inline void *xsp_region_ring_addr(struct xsp_queue *queue, u64 off) {
+  return queue && off < queue->ring_vmalloc_size ? (char *)queue->addrs + off
+                                                 : NULL;
+}
+
+// vmalloc() memory backing byte off of a binding region, NULL for the
+// holes: the rx queues of cpus that never were online and the padding.
+static void *xsp_region_addr(const struct xsp_region_parts *parts, u64 off) {
+  const struct xsp_region_layout *layout = &parts->layout;
+  struct xsp_queue *queue = NULL;
+  u64 i;
+
+  if (off >= layout->size) {
+    return NULL;
+  }
+  if (layout->tx_comps && off >= layout->tx_comps) {
+    off -= layout->tx_comps;
+    i = div64_u64_rem(off, layout->tx_comp_stride, &off);
+    return xsp_region_ring_addr(parts->tx_comp_array->queue[i], off);
+  }
+  if (off >= layout->tx_queues) {
+    off -= layout->tx_queues;
+    i = div64_u64_rem(off, layout->tx_queue_stride, &off);
+    return xsp_region_ring_addr(parts->tx_queue_array->queue[i], off);
+  }
+  if (layout->rx_frames && off >= layout->rx_frames) {
+    off -= layout->rx_frames;
+    i = div64_u64_rem(off, layout->rx_frame_stride, &off);
+    // Pairs with the smp_store_release() in xsp_cpu_online()
+    queue = smp_load_acquire(&parts->rx_queue_array->queue[i]);
+    return queue && off < queue->skb_table->frames_vmalloc_size
+               ? (char *)queue->skb_table->frames + off
+               : NULL;
+  }
+  if (off >= layout->rx_queues) {
+    off -= layout->rx_queues;
+    i = div64_u64_rem(off, layout->rx_queue_stride, &off);
+    queue = smp_load_acquire(&parts->rx_queue_array->queue[i]);
+    return xsp_region_ring_addr(queue, off);
+  }
+  if (layout->tx_dirty && off >= layout->tx_dirty) {
+    off -= layout->tx_dirty;
+    return off < PAGE_ALIGN(sizeof(*parts->tx_dirty))
+               ? (char *)parts->tx_dirty + off
+               : NULL;
+  }
+  return off < PAGE_ALIGN(parts->stats_size) ? (char *)parts->stats + off
+                                             : NULL;
+}
+
+// Rx queues of cpus coming online after the region was mapped are mapped
+// when they are first touched, the other holes raise SIGBUS.
+static vm_fault_t xsp_region_fault(struct vm_fault *vmf) {
+  struct vm_area_struct *vma = vmf->vma;
+  struct xsp_ctx *ctx = vma->vm_file->private_data;
+  struct xsp_region_parts parts;
+  vm_fault_t ret = VM_FAULT_SIGBUS;
+  void *addr = NULL;
+
+  mutex_lock(&ctx->lock);
+  if (!xsp_region_parts_get(ctx, (loff_t)vma->vm_pgoff << PAGE_SHIFT,
+                            &parts)) {
+    addr = xsp_region_addr(&parts, vmf->address - vma->vm_start);
+  }
+  if (addr) {
+    ret = vmf_insert_page(vma, vmf->address, vmalloc_to_page(addr));
+  }
+  mutex_unlock(&ctx->lock);
+  return ret;
+}
+
+static const struct vm_operations_struct xsp_region_vm_ops = {
+    .fault = xsp_region_fault,
+};
+
+// Map the region of a binding at offset into vma, with ctx->lock held. One
+// mapping replaces one per ring, which makes binding fast and leaves a
+// single vma to walk to the consumer. Everything that exists is mapped right
+// away, the stats with the rest of the region and so writable. Only the
+// stats_offset mapping of them is read-only.
+static int xspdev_mmap_binding(struct xsp_ctx *ctx, struct vm_area_struct *vma,
+                               loff_t offset, unsigned long size) {
+  struct xsp_region_parts parts;
+  void *addr = NULL;
+  int ret;
+
+  ret = xsp_region_parts_get(ctx, offset, &parts);
+  if (ret || size > parts.layout.size) {
+    return -EINVAL;
+  }
+
+  vma->vm_ops = &xsp_region_vm_ops;
+  vm_flags_set(vma, VM_MIXEDMAP | VM_DONTEXPAND | VM_DONTDUMP);
+  for (unsigned long off = 0; off < size; off += PAGE_SIZE) {
+    addr = xsp_region_addr(&parts, off);
+    if (!addr) {
+      continue;
+    }
+    ret = vm_insert_page(vma, vma->vm_start + off, vmalloc_to_page(addr));
+    if (ret) {
+      pr_err("failed to mmap region with offset %lld\n", offset);
+      return ret;
+    }
+  }
+  return 0;
+}
+
+// Map the vmalloc() area at addr into vma page by page. Rings and frame areas
+// live on the node of their cpu, which vmalloc_user() can not allocate, so
+// remap_vmalloc_range() refuses them.
+static int xsp_remap_vmalloc(struct vm_area_struct *vma, void *addr) {
+  unsigned long size = vma->vm_end - vma->vm_start;
+  int ret;
+
+  vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+  for (unsigned long off = 0; off < size; off += PAGE_SIZE) {
+    ret = vm_insert_page(vma, vma->vm_start + off,
+                         vmalloc_to_page((char *)addr + off));
+    if (ret) {
+      return ret;
+    }
+  }
+  return 0;
+}
+
+static int xspdev_mmap_locked(struct xsp_ctx *ctx, struct vm_area_struct *vma,
+                              loff_t offset, unsigned long size) {
+  struct offset_queue_entry *entry = NULL;
+  struct xsp_queue *q = NULL;
+
+  entry = offset_queue_table_lookup(&ctx->offsets, offset);
+  if (entry && entry->binding) {
+    return xspdev_mmap_binding(ctx, vma, offset, size);
+  }
+
+  // Pairs with the smp_store_release() in offset_queue_table_set_region()
+  void *region = entry ? smp_load_acquire(&entry->region) : NULL;
+  if (region) {
+    // Regions like the stats of a device are read-only, the frame areas of
+    // the rx queues are writable.
+    if (size > entry->region_size ||
+        (!entry->region_writable && vma->vm_flags & VM_WRITE))
+      return -EINVAL;
+    if (!entry->region_writable)
+      vm_flags_clear(vma, VM_MAYWRITE);
+    return xsp_remap_vmalloc(vma, region);
+  }
+
+  if (!entry || !entry->queue) {
+    pr_err("invalid entry with offset: %llu", offset);
+    return -EINVAL;
+  }
+  q = entry->queue;
+  pr_info("offset: %llu size: %lu queue size: %lu", offset, size,
+          q->ring_vmalloc_size);
+
+  /* Matches the smp_wmb() in xsk_init_queue */
+  smp_rmb();
+  if (size > q->ring_vmalloc_size)
+    return -EINVAL;
+
+  int ret = xsp_remap_vmalloc(vma, q->addrs);
+  if (ret) {
+    pr_err("failed to mmap with offset %lld \n", offset);
+  }
+
+  return ret;
+}
+
+static int xspdev_mmap(struct file *filp, struct vm_area_struct *vma) {
+  struct xsp_ctx *ctx = filp->private_data;
+  loff_t offset = (loff_t)vma->vm_pgoff << PAGE_SHIFT;
+  unsigned long size = vma->vm_end - vma->vm_start;
+  int ret;
+
+  // Unbinding must not free the queue or region while it is mapped here.
+  // Mapped pages stay allocated until they are unmapped.
+  mutex_lock(&ctx->lock);
+  ret = xspdev_mmap_locked(ctx, vma, offset, size);
+  mutex_unlock(&ctx->lock);
+  return ret;
+}
+
+// Readable once any rx queue bound through the file has packets. Every rx
+// queue is marked with XSP_RING_NEED_WAKEUP so that the rx handler wakes us
+// up, the flags of the queues with packets are cleared again. Threads that
+// each own some of the queues wait on their eventfd instead, see
+// IOCTL_RX_EVENTFD.
+static __poll_t xspdev_poll(struct file *file, poll_table *wait) {
+  struct xsp_ctx *ctx = file->private_data;
+  struct dev_queue_entry *entry = NULL;
+  struct xsp_queue *queue = NULL;
+  __poll_t mask = 0;
+
+  // poll_wait() may sleep, ctx->lock rather than rcu_read_lock() keeps the
+  // devices from being unbound. Unbinding wakes up the waiters of the queues
+  // before freeing them.
+  mutex_lock(&ctx->lock);
+  FOR_EACH_CTX_DEV(ctx, entry) {
+    // Members of a rx group share the queues of its first device
+    if (entry->rx_owner) {
+      continue;
+    }
+    FOR_EACH_PRESENT_QUEUE(entry->rx_queue_array, j, queue) {
+      poll_wait(file, &queue->wait, wait);
+      xspq_set_need_wakeup(queue);
+    }
+  }
+
+  // Pairs with the barrier in rx_queue_submit()
+  smp_mb();
+
+  // Empty queues keep their flag, their consumer may still be asleep on an
+  // eventfd
+  FOR_EACH_CTX_DEV(ctx, entry) {
+    if (entry->rx_owner) {
+      continue;
+    }
+    FOR_EACH_PRESENT_QUEUE(entry->rx_queue_array, j, queue) {
+      if (xspq_prod_num(queue)) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+        xspq_clear_need_wakeup(queue);
+      }
+    }
+  }
+  mutex_unlock(&ctx->lock);
+
+  return mask;
+}
+
+// Size of the rx descriptors of a XSP_DESC_FORMAT_*, 0 if unknown.
+static inline u32 rx_desc_size_of(unsigned long format) {
+  switch (format) {
+  case XSP_DESC_FORMAT_BASIC:
+    return sizeof(struct ring_entry);
+  case XSP_DESC_FORMAT_EXT:
+    return sizeof(struct xsp_rx_desc_ext);
+  case XSP_DESC_FORMAT_IF:
+    return sizeof(struct xsp_rx_desc_if);
+  case XSP_DESC_FORMAT_COMPACT:
+    return sizeof(struct xsp_desc_compact);
+  default:
+    return 0;
+  }
+}
+
+// Size of the tx descriptors of a XSP_DESC_FORMAT_*, 0 if unknown.
+static inline u32 tx_desc_size_of(unsigned long format) {
+  switch (format) {
+  case XSP_DESC_FORMAT_BASIC:
+    return sizeof(struct ring_entry);
+  case XSP_DESC_FORMAT_EXT:
+    return sizeof(struct xsp_tx_desc_ext);
+  case XSP_DESC_FORMAT_COMPACT:
+    return sizeof(struct xsp_desc_compact);
+  default:
+    return 0;
+  }
+}
+
+// Skbs of a rx queue stay parked in its skb table while userspace holds
+// their handles, in the rx ring or in its own buffers, so the table has
+// room for two rings. Frame areas have a frame_size window per slot.
+static inline struct skb_table *rx_skb_table_create(struct xsp_ctx *ctx,
+                                                    struct xsp_queue *queue,
+                                                    u32 frame_size) {
+  return skb_table_create(&ctx->skb_tables, queue->nentries * 2, frame_size,
+                          queue->node);
+}
+
+// NUMA node of a device, the one of the caller if the device has none. Tx
+// and completion rings, shared rx rings and the tx poller live there.
+static inline int xsp_dev_node(struct net_device *dev) {
+  int node = dev_to_node(&dev->dev);
+
+  if (node == NUMA_NO_NODE || !node_online(node)) {
+    node = numa_node_id();
+  }
+  return node;
+}
+
+// Whether a device has one rx queue slot per cpu, the rx queues of the
+// others are shared by all cpus and do not follow cpu hotplug.
+static inline bool rx_queues_percpu(struct dev_queue_entry *entry) {
+  return entry->rx_queue_array->size == nr_cpu_ids;
+}
+
+// Lay out the parts of a binding described by info one after the other in
+// its region, see struct xsp_region_layout.
+static void region_layout_init(struct xsp_region_layout *layout,
+                               const struct bind_dev_info *info) {
+  u64 size = PAGE_ALIGN(info->stats_size);
+
+  memset(layout, 0, sizeof(*layout));
+  if (info->flags & XSP_BIND_TX_DIRTY) {
+    layout->tx_dirty = size;
+    size += PAGE_ALIGN(info->tx_dirty_size);
+  }
+  layout->rx_queues = size;
+  layout->rx_queue_stride = info->rx_queue_size;
+  size += info->rx_queue_num * layout->rx_queue_stride;
+  if (info->rx_frame_size) {
+    layout->rx_frames = size;
+    layout->rx_frame_stride = PAGE_ALIGN(info->rx_frame_area_size);
+    size += info->rx_queue_num * layout->rx_frame_stride;
+  }
+  layout->tx_queues = size;
+  layout->tx_queue_stride = info->tx_queue_size;
+  size += info->tx_queue_num * layout->tx_queue_stride;
+  if (info->tx_comp_size) {
+    layout->tx_comps = size;
+    layout->tx_comp_stride = info->tx_comp_size;
+    size += info->tx_queue_num * layout->tx_comp_stride;
+  }
+  layout->size = size;
+}
+
+static struct tx_poller *tx_poller_get(int node);
+static void tx_poller_kick(struct tx_poller *poller);
+static void dev_entry_destroy(struct dev_queue_entry *entry);
+
+// Called with rtnl and bind_lock held.
+static int bind_dev_locked(struct xsp_ctx *ctx, struct net_device *dev,
+                           struct bind_dev_info *info) {
+  int ret;
+
+  // Check if the device is already binded in dev queue table
+  if (dev_queue_table_lookup(&global_dev_queue_table, dev) != NULL) {
+    pr_err("Device is already binded in dev queue table\n");
+    return -EBUSY;
+  }
+
+  // Check the requested ring geometry, 0 picks the default
+  unsigned long rx_ring_depth =
+      info->rx_ring_depth ? info->rx_ring_depth : QUEUE_ENTRY_NUM;
+  unsigned long tx_ring_depth =
+      info->tx_ring_depth ? info->tx_ring_depth : QUEUE_ENTRY_NUM;
+  unsigned long tx_queue_num_req =
+      info->tx_queue_num ? info->tx_queue_num : num_online_cpus();
+  if (!xspq_nentries_valid(rx_ring_depth) ||
+      !xspq_nentries_valid(tx_ring_depth) ||
+      tx_queue_num_req > XSP_MAX_TX_QUEUE_NUM) {
+    pr_err("Invalid ring geometry, rx depth: %lu tx depth: %lu tx num: %lu\n",
+           rx_ring_depth, tx_ring_depth, tx_queue_num_req);
+    return -EINVAL;
+  }
+  if (info->desc_version > XSP_DESC_VERSION) {
+    pr_err("Unknown descriptor version: %lu\n", info->desc_version);
+    return -EINVAL;
+  }
+  u32 rx_desc_size = rx_desc_size_of(info->rx_desc_format);
+  u32 tx_desc_size = tx_desc_size_of(info->tx_desc_format);
+  if (!rx_desc_size || !tx_desc_size) {
+    pr_err("Unknown descriptor format, rx: %lu tx: %lu\n",
+           info->rx_desc_format, info->tx_desc_format);
+    return -EINVAL;
+  }
+  // Header windows are described by the extended descriptor only
+  u32 rx_frame_size = info->rx_frame_size;
+  if (rx_frame_size &&
+      (info->rx_desc_format != XSP_DESC_FORMAT_EXT ||
+       rx_frame_size > XSP_FRAME_MAX_SIZE || rx_frame_size % XSP_FRAME_ALIGN)) {
+    pr_err("Invalid rx frame size: %lu\n", info->rx_frame_size);
+    return -EINVAL;
+  }
+  // Devices of a rx group share the rx queues of its first device
+  struct dev_queue_entry *rx_owner = NULL;
+  if (info->rx_group) {
+    if ((info->rx_desc_format != XSP_DESC_FORMAT_IF &&
+         info->rx_desc_format != XSP_DESC_FORMAT_COMPACT) ||
+        rx_frame_size) {
+      pr_err("Rx groups need descriptors with ifindex and no frame areas\n");
+      return -EINVAL;
+    }
+    // Members read the rings of the first device, which fixed their format
+    rx_owner = xa_load(&ctx->rx_groups, info->rx_group);
+    if (rx_owner && rx_owner->rx_desc_size != rx_desc_size) {
+      pr_err("Rx group %lu has another descriptor format\n", info->rx_group);
+      return -EINVAL;
+    }
+    if (rx_owner) {
+      rx_ring_depth = rx_owner->rx_ring_depth;
+    }
+  }
+
+  // Create queue array for tx and rx. Rx queues are produced by the cpu
+  // receiving the packet, so by default there is one slot per possible cpu
+  // and only the online ones get a queue now, see xsp_cpu_online(). Less
+  // rx queues are shared by the cpus and all of them exist from the start.
+  // Per cpu rx rings are allocated on the node of their cpu, the others on
+  // the node of the device.
+  bool rx_shared = info->rx_queue_num && info->rx_queue_num < nr_cpu_ids;
+  int node = xsp_dev_node(dev);
+  struct queue_array *tx_queue_array = queue_array_create(
+      tx_queue_num_req, tx_ring_depth, tx_desc_size, node);
+  struct queue_array *rx_queue_array = NULL;
+  if (rx_owner) {
+    rx_queue_array = rx_owner->rx_queue_array;
+    rx_shared = !rx_queues_percpu(rx_owner);
+  } else {
+    rx_queue_array =
+        rx_shared ? queue_array_create(info->rx_queue_num, rx_ring_depth,
+                                       rx_desc_size, node)
+                  : queue_array_create_percpu(cpu_online_mask, rx_ring_depth,
+                                              rx_desc_size);
+  }
+  if (!tx_queue_array || !rx_queue_array) {
+    pr_err("Failed to create queue array\n");
+    if (tx_queue_array) {
+      queue_array_destroy(tx_queue_array);
+    }
+    if (rx_queue_array && !rx_owner) {
+      queue_array_destroy(rx_queue_array);
+    }
+    return -ENOMEM;
+  }
+  if (rx_shared && !rx_owner) {
+    FOR_EACH_QUEUE(rx_queue_array, i) {
+      rx_queue_array->queue[i]->shared_prod = true;
+    }
+  }
+  struct xsp_queue *rx_queue = NULL;
+  FOR_EACH_PRESENT_QUEUE(rx_queue_array, i, rx_queue) {
+    if (rx_owner) {
+      break;
+    }
+    rx_queue->skb_table = rx_skb_table_create(ctx, rx_queue, rx_frame_size);
+    if (!rx_queue->skb_table) {
+      pr_err("Failed to create skb table\n");
+      FOR_EACH_PRESENT_QUEUE(rx_queue_array, j, rx_queue) {
+        skb_table_destroy(rx_queue->skb_table);
+      }
+      queue_array_destroy(tx_queue_array);
+      queue_array_destroy(rx_queue_array);
+      return -ENOMEM;
+    }
+  }
+  size_t rx_queue_num = rx_queue_array->size;
+  size_t tx_queue_num = tx_queue_array->size;
+
+  // Add queue array to queue array list
+  queue_array_list_insert(&ctx->queue_arrays, tx_queue_array);
+  if (!rx_owner) {
+    queue_array_list_insert(&ctx->queue_arrays, rx_queue_array);
+  }
+
+  // Create the stats region shared with userspace
+  struct xsp_stats_region *stats = NULL;
+  size_t stats_size =
+      PAGE_ALIGN(struct_size(stats, queues, rx_queue_num + tx_queue_num));
+  stats = vmalloc_user(stats_size);
+  if (!stats) {
+    pr_err("Failed to create stats region\n");
+    ret = -ENOMEM;
+    goto err_queues;
+  }
+  stats->rx_queue_num = rx_queue_num;
+  stats->tx_queue_num = tx_queue_num;
+  FOR_EACH_QUEUE(rx_queue_array, i) {
+    stats->queues[i].cpu = rx_shared ? XSP_QUEUE_NO_CPU : i;
+    stats->queues[i].node = rx_queue_array->queue[i]
+                                ? rx_queue_array->queue[i]->node
+                                : cpu_to_node(i);
+    if (rx_queue_array->queue[i]) {
+      stats->queues[i].state = XSP_QUEUE_ONLINE;
+      if (!rx_owner) {
+        rx_queue_array->queue[i]->stats = &stats->queues[i];
+      }
+    }
+  }
+  FOR_EACH_QUEUE(tx_queue_array, i) {
+    stats->queues[rx_queue_num + i].cpu = XSP_QUEUE_NO_CPU;
+    stats->queues[rx_queue_num + i].node = node;
+    stats->queues[rx_queue_num + i].state = XSP_QUEUE_ONLINE;
+    tx_queue_array->queue[i]->stats = &stats->queues[rx_queue_num + i];
+  }
+
+  // Insert queue array to dev queue table
+  struct dev_queue_entry *dev_entry = dev_queue_table_insert(
+      &global_dev_queue_table, dev, tx_queue_array, rx_queue_array);
+  if (!dev_entry) {
+    pr_err("Failed to insert dev queue table\n");
+    ret = -ENOMEM;
+    goto err_queues;
+  }
+  dev_entry->ctx = ctx;
+  INIT_LIST_HEAD(&dev_entry->ctx_node);
+  dev_entry->stats = stats;
+  dev_entry->stats_size = stats_size;
+  dev_entry->rx_ring_depth = rx_ring_depth;
+  dev_entry->rx_desc_size = rx_desc_size;
+  dev_entry->rx_frame_size = rx_frame_size;
+  dev_entry->rx_owner = rx_owner;
+  dev_entry->rx_group = info->rx_group;
+  if (info->rx_group && !rx_owner) {
+    ret = xa_err(
+        xa_store(&ctx->rx_groups, info->rx_group, dev_entry, GFP_KERNEL));
+    if (ret) {
+      pr_err("Failed to create rx group %lu\n", info->rx_group);
+      goto err;
+    }
+  }
+  if (info->flags & XSP_BIND_TX_POLL) {
+    struct tx_poller *poller = tx_poller_get(node);
+    if (!poller) {
+      pr_err("Failed to create tx poller of node %d\n", node);
+      ret = -ENOMEM;
+      goto err;
+    }
+    // Userspace kicks the poller after its first submit
+    FOR_EACH_QUEUE(tx_queue_array, i) {
+      xspq_set_need_wakeup(tx_queue_array->queue[i]);
+    }
+    WRITE_ONCE(dev_entry->tx_poller, poller);
+    tx_poller_kick(poller);
+  }
+
+  // Tx rings marked by userspace, see XSP_BIND_TX_DIRTY
+  struct xsp_tx_dirty *tx_dirty = NULL;
+  size_t tx_dirty_size = 0;
+  if (info->flags & XSP_BIND_TX_DIRTY) {
+    tx_dirty_size = PAGE_ALIGN(sizeof(*tx_dirty));
+    tx_dirty = vmalloc_user(tx_dirty_size);
+    if (!tx_dirty) {
+      pr_err("Failed to create tx dirty region\n");
+      ret = -ENOMEM;
+      goto err;
+    }
+  }
+  dev_entry->tx_dirty = tx_dirty;
+
+  // Completion rings of the tx queues, see XSP_BIND_TX_COMPLETION. Skbs of
+  // a busy device are handed back through the skb table of the tx queue.
+  struct queue_array *tx_comp_array = NULL;
+  if (info->flags & XSP_BIND_TX_COMPLETION) {
+    tx_comp_array = queue_array_create(
+        tx_queue_num, tx_ring_depth, sizeof(struct xsp_tx_completion), node);
+    if (!tx_comp_array) {
+      pr_err("Failed to create tx completion rings\n");
+      ret = -ENOMEM;
+      goto err;
+    }
+    queue_array_list_insert(&ctx->queue_arrays, tx_comp_array);
+    dev_entry->tx_comp_array = tx_comp_array;
+    FOR_EACH_QUEUE(tx_queue_array, i) {
+      struct xsp_queue *tx_queue = tx_queue_array->queue[i];
+      tx_queue->skb_table =
+          skb_table_create(&ctx->skb_tables, tx_ring_depth, 0, node);
+      if (!tx_queue->skb_table) {
+        pr_err("Failed to create skb table\n");
+        ret = -ENOMEM;
+        goto err;
+      }
+      tx_queue->comp = tx_comp_array->queue[i];
+    }
+  }
+  size_t tx_comp_num = tx_comp_array ? tx_queue_num : 0;
+
+  // Assign offset to each queue and add to offset queue table, followed by
+  // the frame areas of the rx queues, the stats region, the tx dirty region,
+  // the tx completion rings and the region of the whole binding. Rx slots
+  // without a queue get offsets as well, members of a rx group use the ones
+  // of its first device.
+  size_t rx_offset_num = rx_owner ? 0 : rx_queue_num;
+  size_t rx_frame_area_num = rx_frame_size ? rx_queue_num : 0;
+  size_t offset_num = tx_queue_num + rx_offset_num + rx_frame_area_num + 1 +
+                      !!tx_dirty + tx_comp_num + 1;
+  loff_t offset =
+      offset_queue_fetch_next(&ctx->offsets, offset_num);
+  if (offset < 0) {
+    pr_err("Failed to reserve mmap offsets\n");
+    ret = offset;
+    goto err;
+  }
+  dev_entry->offset_start = offset;
+  dev_entry->offset_num = offset_num;
+  loff_t tx_offset_start = offset;
+  loff_t rx_offset_start = offset;
+  struct xsp_queue *queue = NULL;
+  FOR_EACH_QUEUE(tx_queue_array, i) {
+    queue = tx_queue_array->queue[i];
+    ret = offset_queue_table_insert_tx(&ctx->offsets, offset, dev, queue);
+    if (ret) {
+      goto err_offsets;
+    }
+    offset += PAGE_SIZE;
+  }
+  rx_offset_start = rx_owner ? rx_owner->rx_start_offset : offset;
+  FOR_EACH_QUEUE(rx_queue_array, i) {
+    if (rx_owner) {
+      break;
+    }
+    queue = rx_queue_array->queue[i];
+    ret = offset_queue_table_insert(&ctx->offsets, offset, dev, queue);
+    if (ret) {
+      goto err_offsets;
+    }
+    offset += PAGE_SIZE;
+  }
+  dev_entry->rx_start_offset = rx_offset_start;
+  loff_t rx_frame_offset_start = offset;
+  size_t rx_frame_area_size = 0;
+  if (rx_frame_size) {
+    FOR_EACH_QUEUE(rx_queue_array, i) {
+      struct skb_table *table = rx_queue_array->queue[i]
+                                    ? rx_queue_array->queue[i]->skb_table
+                                    : NULL;
+      ret = offset_queue_table_insert_region(
+          &ctx->offsets, offset, dev, table ? table->frames : NULL,
+          table ? table->frames_vmalloc_size : 0, true);
+      if (ret) {
+        goto err_offsets;
+      }
+      offset += PAGE_SIZE;
+    }
+    rx_frame_area_size = skb_table_frames_size_for(rx_ring_depth * 2,
+                                                   rx_frame_size);
+  }
+  dev_entry->rx_frame_start_offset = rx_frame_offset_start;
+  loff_t stats_offset = offset;
+  ret = offset_queue_table_insert_region(&ctx->offsets, stats_offset, dev,
+                                         stats, stats_size, false);
+  if (ret) {
+    goto err_offsets;
+  }
+  offset = stats_offset + PAGE_SIZE;
+  loff_t tx_dirty_offset = offset;
+  if (tx_dirty) {
+    ret = offset_queue_table_insert_region(&ctx->offsets, tx_dirty_offset,
+                                           dev, tx_dirty, tx_dirty_size, true);
+    if (ret) {
+      goto err_offsets;
+    }
+    offset += PAGE_SIZE;
+  }
+  loff_t tx_comp_offset_start = offset;
+  if (tx_comp_array) {
+    FOR_EACH_QUEUE(tx_comp_array, i) {
+      ret = offset_queue_table_insert(&ctx->offsets, offset, dev,
+                                      tx_comp_array->queue[i]);
+      if (ret) {
+        goto err_offsets;
+      }
+      offset += PAGE_SIZE;
+    }
+  }
+  loff_t region_offset = offset;
+  ret = offset_queue_table_insert_binding(&ctx->offsets, region_offset, dev);
+  if (ret) {
+    goto err_offsets;
+  }
+
+  // Set rx handler for the device
+  ret = netdev_rx_handler_register(dev, xsp_handle_frame, rx_queue_array);
+  if (ret) {
+    pr_err("register %s rx handle, result: %d", info->dev_name, ret);
+    goto err;
+  }
+
+  // Copy out argruments into info
+  info->desc_version = XSP_DESC_VERSION;
+  info->step = PAGE_SIZE;
+  info->rx_start_offset = rx_offset_start;
+  info->rx_queue_num = rx_queue_num;
+  info->rx_queue_size = xspq_size_for(rx_ring_depth, rx_desc_size);
+  info->rx_ring_depth = rx_ring_depth;
+  info->rx_desc_size = rx_desc_size;
+  info->tx_start_offset = tx_offset_start;
+  info->tx_queue_num = tx_queue_num;
+  info->tx_queue_size = xspq_size_for(tx_ring_depth, tx_desc_size);
+  info->tx_ring_depth = tx_ring_depth;
+  info->tx_desc_size = tx_desc_size;
+  info->rx_frame_size = rx_frame_size;
+  info->rx_frame_start_offset = rx_frame_size ? rx_frame_offset_start : 0;
+  info->rx_frame_area_size = rx_frame_area_size;
+  info->stats_offset = stats_offset;
+  info->stats_size = stats_size;
+  info->tx_dirty_offset = tx_dirty ? tx_dirty_offset : 0;
+  info->tx_dirty_size = tx_dirty_size;
+  info->tx_comp_start_offset = tx_comp_array ? tx_comp_offset_start : 0;
+  info->tx_comp_size =
+      tx_comp_array
+          ? xspq_size_for(tx_ring_depth, sizeof(struct xsp_tx_completion))
+          : 0;
+  region_layout_init(&dev_entry->region, info);
+  info->region_offset = region_offset;
+  info->region = dev_entry->region;
+
+  // Only now poll() and the release of the file see the device
+  mutex_lock(&ctx->lock);
+  list_add_tail_rcu(&dev_entry->ctx_node, &ctx->devs);
+  mutex_unlock(&ctx->lock);
+  return 0;
+
+err_offsets:
+  pr_err("Failed to insert mmap offsets\n");
+err:
+  // The rx handler is not registered, no packet reached the queues
+  dev_entry_destroy(dev_entry);
+  return ret;
+
+err_queues:
+  // Only the queues, their skb tables and the stats region exist yet
+  if (!rx_owner) {
+    FOR_EACH_PRESENT_QUEUE(rx_queue_array, i, rx_queue) {
+      skb_table_destroy(rx_queue->skb_table);
+    }
+    queue_array_list_remove(&ctx->queue_arrays, rx_queue_array);
+  }
+  queue_array_list_remove(&ctx->queue_arrays, tx_queue_array);
+  vfree(stats);
+  return ret;
+}
+
+static int bind_dev(struct xsp_ctx *ctx, void *user_info_addr) {
+  struct bind_dev_info info;
+  int ret;
+  if (copy_from_user(&info, (struct bind_dev_info *)user_info_addr,
+                     sizeof(info))) {
+    pr_err("copy_from_user failed\n");
+    return -EFAULT;
+  }
+  info.dev_name[sizeof(info.dev_name) - 1] = '\0';
+
+  // Cpu hotplug callbacks must not see a half bound device. rtnl comes
+  // first, the netdev notifier takes bind_lock with it held. The device is
+  // looked up under rtnl as well, so that one being unregistered is not
+  // bound after its NETDEV_UNREGISTER notification and never released.
+  rtnl_lock();
+  struct net_device *dev = __dev_get_by_name(&init_net, info.dev_name);
+  if (!dev || dev->reg_state != NETREG_REGISTERED) {
+    rtnl_unlock();
+    pr_err("Device not found by name: %s\n", info.dev_name);
+    return -ENODEV;
+  }
+  dev_hold(dev);
+  mutex_lock(&bind_lock);
+  ret = bind_dev_locked(ctx, dev, &info);
+  mutex_unlock(&bind_lock);
+  rtnl_unlock();
+  if (ret) {
+    dev_put(dev);
+    return ret;
+  }
+
+  ret = copy_to_user(user_info_addr, &info, sizeof(struct bind_dev_info));
+  if (ret) {
+    pr_err("copy_to_user failed %d \n", ret);
+  }
+
+  pr_info("bind dev %s successfully\n", info.dev_name);
+  return ret;
+}
+
+// Take the device of entry out of every table and free what it owns, with
+// bind_lock held. Its rx handler must not run anymore. The reference on the
+// device is left to the caller.
+static void dev_entry_destroy(struct dev_queue_entry *entry) {
+  struct xsp_ctx *ctx = entry->ctx;
+  struct net_device *dev = entry->dev;
+  struct xsp_queue *queue = NULL;
+
+  flow_table_remove_dev(&global_flow_table, dev);
+  port_group_table_remove_dev(&ctx->port_groups, dev);
+  if (entry->rx_group && xa_load(&ctx->rx_groups, entry->rx_group) == entry) {
+    xa_erase(&ctx->rx_groups, entry->rx_group);
+  }
+
+  // The entry is freed after the grace period below
+  struct queue_array *tx_queue_array = entry->tx_queue_array;
+  struct queue_array *rx_queue_array =
+      entry->rx_owner ? NULL : entry->rx_queue_array;
+  struct queue_array *tx_comp_array = entry->tx_comp_array;
+  struct xsp_stats_region *stats = entry->stats;
+  struct xsp_tx_dirty *tx_dirty = entry->tx_dirty;
+  dev_queue_table_remove(&global_dev_queue_table, dev);
+  // No new mmap, poll or send finds the queues. The offsets can be given
+  // back right away, binding waits for bind_lock.
+  mutex_lock(&ctx->lock);
+  if (!list_empty(&entry->ctx_node)) {
+    list_del_rcu(&entry->ctx_node);
+  }
+  offset_queue_release(&ctx->offsets, entry->offset_start, entry->offset_num);
+  mutex_unlock(&ctx->lock);
+
+  // Handles of the skbs parked in the queues are no longer claimed, the
+  // skbs are freed with their tables
+  if (rx_queue_array) {
+    FOR_EACH_PRESENT_QUEUE(rx_queue_array, i, queue) {
+      skb_table_unregister(queue->skb_table);
+      wake_up_pollfree(&queue->wait);
+    }
+  }
+  FOR_EACH_QUEUE(tx_queue_array, i) {
+    skb_table_unregister(tx_queue_array->queue[i]->skb_table);
+  }
+
+  // Wait for the senders and pollers still using the queues or the device
+  synchronize_rcu();
+
+  if (rx_queue_array) {
+    FOR_EACH_PRESENT_QUEUE(rx_queue_array, i, queue) {
+      skb_table_destroy(queue->skb_table);
+    }
+    queue_array_list_remove(&ctx->queue_arrays, rx_queue_array);
+  }
+  FOR_EACH_QUEUE(tx_queue_array, i) {
+    skb_table_destroy(tx_queue_array->queue[i]->skb_table);
+  }
+  queue_array_list_remove(&ctx->queue_arrays, tx_queue_array);
+  if (tx_comp_array) {
+    queue_array_list_remove(&ctx->queue_arrays, tx_comp_array);
+  }
+  vfree(stats);
+  vfree(tx_dirty);
+}
+
+// Unbind the device of entry, with rtnl, cpus_read_lock() and bind_lock
+// held. The first device of a rx group owns the rx queues of the group, it
+// is only unbound while other members exist if force is set, and takes them
+// along.
+static int unbind_dev_locked(struct dev_queue_entry *entry, bool force) {
+  struct net_device *dev = entry->dev;
+  struct dev_queue_entry *member = NULL;
+  struct dev_queue_entry *tmp = NULL;
+
+  if (!entry->rx_owner) {
+    list_for_each_entry_safe(member, tmp, &global_dev_queue_table.entries,
+                             list_node) {
+      if (member->rx_owner != entry) {
+        continue;
+      }
+      if (!force) {
+        pr_err("Rx group %u of %s still has members\n", entry->rx_group,
+               dev->name);
+        return -EBUSY;
+      }
+      unbind_dev_locked(member, true);
+    }
+  }
+
+  // Waits for the rx handler running on other cpus, what it held back in
+  // the batches is published before the queues go away
+  netdev_rx_handler_unregister(dev);
+  if (!entry->rx_owner) {
+    rx_batches_drain();
+  }
+  dev_entry_destroy(entry);
+
+  pr_info("unbind dev %s\n", dev->name);
+  dev_put(dev);
+  return 0;
+}
+
+static int unbind_dev(struct xsp_ctx *ctx, void *user_info_addr) {
+  struct unbind_dev_info info;
+  struct dev_queue_entry *entry = NULL;
+  int ret = -ENODEV;
+
+  if (copy_from_user(&info, (struct unbind_dev_info *)user_info_addr,
+                     sizeof(info))) {
+    pr_err("copy_from_user failed\n");
+    return -EFAULT;
+  }
+  info.dev_name[sizeof(info.dev_name) - 1] = '\0';
+
+  rtnl_lock();
+  cpus_read_lock();
+  mutex_lock(&bind_lock);
+  struct net_device *dev = __dev_get_by_name(&init_net, info.dev_name);
+  entry = dev ? dev_queue_table_lookup(&global_dev_queue_table, dev) : NULL;
+  // Devices bound through another file are not ours to unbind
+  if (entry && entry->ctx == ctx) {
+    ret = unbind_dev_locked(entry, false);
+  }
+  mutex_unlock(&bind_lock);
+  cpus_read_unlock();
+  rtnl_unlock();
+  return ret;
+}
+
+// Unbind devices going away, e.g. the veth of a namespace being deleted.
+static int xsp_netdev_event(struct notifier_block *nb, unsigned long event,
+                            void *ptr) {
+  struct net_device *dev = netdev_notifier_info_to_dev(ptr);
+  struct dev_queue_entry *entry = NULL;
+
+  if (event != NETDEV_UNREGISTER) {
+    return NOTIFY_DONE;
+  }
+  cpus_read_lock();
+  mutex_lock(&bind_lock);
+  entry = dev_queue_table_lookup(&global_dev_queue_table, dev);
+  if (entry) {
+    unbind_dev_locked(entry, true);
+  }
+  mutex_unlock(&bind_lock);
+  cpus_read_unlock();
+  return NOTIFY_DONE;
+}
+
+static struct notifier_block xsp_netdev_notifier = {
+    .notifier_call = xsp_netdev_event,
+};
+
+// Give every bound device a rx queue for a cpu that came online. Runs on
+// that cpu before it receives packets for the bound devices in most cases,
+// the rx handler drops what arrives before.
+static int xsp_cpu_online(unsigned int cpu) {
+  struct dev_queue_entry *entry = NULL;
+  struct xsp_queue *queue = NULL;
+
+  mutex_lock(&bind_lock);
+  FOR_EACH_BOUND_DEV(entry) {
+    struct queue_array *rx_queue_array = entry->rx_queue_array;
+    if (!rx_queues_percpu(entry)) {
+      continue;
+    }
+    // Members of a rx group come after its first device, which already
+    // created the queue
+    if (!rx_queue_array->queue[cpu] && !entry->rx_owner) {
+      queue = xspq_create_desc_node(entry->rx_ring_depth,
+                                    entry->rx_desc_size, cpu_to_node(cpu));
+      if (!queue) {
+        pr_err("Failed to create rx queue of cpu %u for %s\n", cpu,
+               entry->dev->name);
+        continue;
+      }
+      queue->skb_table =
+          rx_skb_table_create(entry->ctx, queue, entry->rx_frame_size);
+      if (!queue->skb_table) {
+        pr_err("Failed to create skb table of cpu %u for %s\n", cpu,
+               entry->dev->name);
+        xspq_destroy(queue);
+        continue;
+      }
+      queue->stats = &entry->stats->queues[cpu];
+      offset_queue_table_set_queue(&entry->ctx->offsets,
+                                   entry->rx_start_offset + cpu * PAGE_SIZE,
+                                   queue);
+      if (entry->rx_frame_size) {
+        offset_queue_table_set_region(
+            &entry->ctx->offsets,
+            entry->rx_frame_start_offset + cpu * PAGE_SIZE,
+            queue->skb_table->frames, queue->skb_table->frames_vmalloc_size);
+      }
+      // Pairs with the READ_ONCE() in xsp_handle_frame()
+      smp_store_release(&rx_queue_array->queue[cpu], queue);
+    }
+    WRITE_ONCE(entry->stats->queues[cpu].state, XSP_QUEUE_ONLINE);
+    WRITE_ONCE(entry->stats->layout_gen, entry->stats->layout_gen + 1);
+  }
+  mutex_unlock(&bind_lock);
+  return 0;
+}
+
+// Retire the rx queues of a cpu going offline. They stay mapped, so that
+// userspace can drain them, and are used again if the cpu comes back.
+static int xsp_cpu_offline(unsigned int cpu) {
+  struct dev_queue_entry *entry = NULL;
+
+  // Runs on the cpu going down, publish what its rx queues hold back.
+  local_bh_disable();
+  rx_batch_flush(this_cpu_ptr(&rx_batch));
+  local_bh_enable();
+
+  mutex_lock(&bind_lock);
+  FOR_EACH_BOUND_DEV(entry) {
+    if (rx_queues_percpu(entry) && entry->rx_queue_array->queue[cpu]) {
+      WRITE_ONCE(entry->stats->queues[cpu].state, XSP_QUEUE_RETIRED);
+      WRITE_ONCE(entry->stats->layout_gen, entry->stats->layout_gen + 1);
+    }
   }
+  mutex_unlock(&bind_lock);
+  return 0;
+}
 
-  // Try to get rx_queue from dev->rx_handler_data.
-  // If not set, return RX_HANDLER_PASS.
-  void *data = rcu_dereference(dev->rx_handler_data);
-  if (!data) {
-    pr_warn("rx_queue_array not set in this dev, pass\n");
-    return RX_HANDLER_PASS;
+// Bound through ctx, with bind_lock held
+static inline bool dev_bound_by(struct xsp_ctx *ctx, struct net_device *dev) {
+  struct dev_queue_entry *entry =
+      dev_queue_table_lookup(&global_dev_queue_table, dev);
+
+  return entry && entry->ctx == ctx;
+}
+
+// Add or remove a flow of the in-kernel flow table. Both devices must be
+// bound through ctx, flows are removed together with their devices.
+static int update_flow(struct xsp_ctx *ctx, void *user_info_addr, bool add) {
+  struct flow_rule_info info;
+  struct net_device *in_dev = NULL;
+  struct net_device *out_dev = NULL;
+  int ret;
+
+  if (copy_from_user(&info, (struct flow_rule_info *)user_info_addr,
+                     sizeof(info))) {
+    pr_err("copy_from_user failed\n");
+    return -EFAULT;
   }
+  info.in_dev_name[sizeof(info.in_dev_name) - 1] = '\0';
+  info.out_dev_name[sizeof(info.out_dev_name) - 1] = '\0';
 
-  // Get queue using the cpu id
-  rx_queue_array = (struct queue_array *)data;
-  int cpu_id;
-  cpu_id = smp_processor_id();
-  BUG_ON(cpu_id >= CORE_NUM);
-  struct xsp_queue *queue = rx_queue_array->queue[cpu_id];
+  in_dev = dev_get_by_name(&init_net, info.in_dev_name);
+  if (!in_dev) {
+    pr_err("Device not found by name: %s\n", info.in_dev_name);
+    return -ENODEV;
+  }
+  // The devices must stay bound until the flow is in the table
+  mutex_lock(&bind_lock);
+  if (!dev_bound_by(ctx, in_dev)) {
+    ret = -EINVAL;
+    goto out;
+  }
+  if (!add) {
+    ret = flow_table_remove(&global_flow_table, info.dst_mac, in_dev);
+    goto out;
+  }
 
-  skb = skb_share_check(skb, GFP_ATOMIC);
-  if (!skb) {
-    pr_warn("fail to share check skb");
-    return RX_HANDLER_CONSUMED;
+  out_dev = dev_get_by_name(&init_net, info.out_dev_name);
+  if (!out_dev) {
+    pr_err("Device not found by name: %s\n", info.out_dev_name);
+    ret = -ENODEV;
+    goto out;
+  }
+  if (!dev_bound_by(ctx, out_dev)) {
+    ret = -EINVAL;
+    goto out;
   }
+  ret = flow_table_insert(&global_flow_table, info.dst_mac, in_dev, out_dev);
 
-  u64 src_mac = 0;
-  u64 dst_mac = 0;
+out:
+  mutex_unlock(&bind_lock);
+  if (out_dev) {
+    dev_put(out_dev);
+  }
+  dev_put(in_dev);
+  return ret;
+}
 
-  if (unlikely(!pskb_may_pull(skb, sizeof(struct ethhdr)))) {
-    pr_warn("skb does not contain a complete ethernet header, pass\n");
-    return RX_HANDLER_PASS;
+// Rewrite the headers and metadata of skb as asked by the actions of a tx
+// descriptor, while they are hot in cache. skb->data is past the ethernet
+// header.
+static int tx_apply_actions(struct sk_buff *skb,
+                            const struct xsp_tx_desc_ext *desc) {
+  u32 actions = desc->actions;
+  int err = 0;
+
+  if (actions & XSP_TX_ACT_SET_PRIORITY) {
+    skb->priority = desc->priority;
+  }
+  if (actions & XSP_TX_ACT_SET_MARK) {
+    skb->mark = desc->mark;
+  }
+  if (!(actions & (XSP_TX_ACT_VLAN_POP | XSP_TX_ACT_VLAN_PUSH |
+                   XSP_TX_ACT_SET_SRC_MAC | XSP_TX_ACT_SET_DST_MAC))) {
+    return 0;
   }
-  struct ethhdr *eth = eth_hdr(skb);
-  memcpy(&src_mac, eth->h_source, ETH_ALEN);
-  memcpy(&dst_mac, eth->h_dest, ETH_ALEN);
 
-  if (xspq_prod_reserve_addr(queue, (u64)skb, src_mac, dst_mac) != 0) {
-    pr_warn("fail to reserve addr, drop skb");
-    consume_skb(skb);
-  } else {
-    xspq_prod_submit(queue);
+  // The vlan helpers work on skbs whose data starts at the mac header
+  skb_push(skb, ETH_HLEN);
+  skb_reset_mac_header(skb);
+  if (actions & XSP_TX_ACT_VLAN_POP) {
+    err = skb_vlan_pop(skb);
   }
+  if (!err && actions & XSP_TX_ACT_VLAN_PUSH) {
+    __be16 proto = desc->vlan_proto ? htons(desc->vlan_proto)
+                                    : htons(ETH_P_8021Q);
+    err = skb_vlan_push(skb, proto, desc->vlan_tci);
+  }
+  if (!err && actions & (XSP_TX_ACT_SET_SRC_MAC | XSP_TX_ACT_SET_DST_MAC)) {
+    err = skb_ensure_writable(skb, ETH_HLEN);
+    if (!err) {
+      struct ethhdr *eth = (struct ethhdr *)skb->data;
+      if (actions & XSP_TX_ACT_SET_SRC_MAC) {
+        memcpy(eth->h_source, &desc->src_mac, ETH_ALEN);
+      }
+      if (actions & XSP_TX_ACT_SET_DST_MAC) {
+        memcpy(eth->h_dest, &desc->dst_mac, ETH_ALEN);
+      }
+    }
+  }
+  __skb_pull(skb, ETH_HLEN);
+  return err;
+}
 
-  return RX_HANDLER_CONSUMED;
+// Send the descriptors of a tx queue, returns how many were read.
+static inline int handle_send(struct dev_queue_entry *entry,
+                              struct xsp_queue *queue) {
+  if (!entry || !queue) {
+    pr_err("Error in offset table");
+    return -EINVAL;
+  }
+  struct net_device *dev = entry->dev;
+  struct xsp_queue_stats *stats = queue->stats;
+  u32 nb_pkts = xspq_cons_nb_entries(queue, 4096);
+  if (!nb_pkts) {
+    return 0;
+  }
+  stats->batches++;
+  struct skb_table_batch released = {0};
+  struct tx_bulk bulk;
+  tx_bulk_init(&bulk, entry->ctx, queue);
+  // Smaller descriptors only fill the head of desc, up to the handle of
+  // basic ones and the ifindex of compact ones
+  bool ext = queue->desc_size == sizeof(struct xsp_tx_desc_ext);
+  bool compact = queue->desc_size == sizeof(struct xsp_desc_compact);
+  struct xsp_tx_desc_ext desc;
+  for (u32 i = 0; i < nb_pkts; i++) {
+    xspq_cons_read_desc_unchecked_inc(queue, &desc);
+
+    // xmit the packet to dev
+    struct sk_buff *skb =
+        skb_table_claim(&entry->ctx->skb_tables, desc.addr, &released);
+    if (!skb) {
+      stats->invalid_descs++;
+      tx_complete(&bulk, desc.addr, XSP_TX_STATUS_INVALID, 0);
+      continue;
+    }
+    TX_SKB_CB(skb)->handle = desc.addr;
+    TX_SKB_CB(skb)->fanout = 0;
+    // Apply the edits of userspace to the header window
+    u32 frame_len = 0;
+    void *frame = skb_table_claimed_frame(&released, &frame_len);
+    if (frame && frame_len && tx_frame_store(skb, frame, frame_len)) {
+      stats->tx_dropped++;
+      tx_bulk_fail(&bulk, skb, XSP_TX_STATUS_DROPPED);
+      continue;
+    }
+    if (ext && desc.actions && tx_apply_actions(skb, &desc)) {
+      stats->tx_dropped++;
+      tx_bulk_fail(&bulk, skb, XSP_TX_STATUS_DROPPED);
+      continue;
+    }
+    if (ext && desc.actions & XSP_TX_ACT_FANOUT) {
+      tx_bulk_fanout(&bulk, desc.group, skb);
+      continue;
+    }
+    struct net_device *out_dev = dev;
+    u32 ifindex = 0;
+    if (ext) {
+      ifindex = desc.ifindex;
+    } else if (compact) {
+      ifindex = ((struct xsp_desc_compact *)&desc)->ifindex;
+    }
+    if (ifindex && ifindex != dev->ifindex) {
+      out_dev = tx_bulk_resolve(&bulk, ifindex);
+      if (!out_dev) {
+        stats->tx_not_forwardable++;
+        tx_bulk_fail(&bulk, skb, XSP_TX_STATUS_NOT_FORWARDABLE);
+        continue;
+      }
+    }
+    tx_bulk_add(&bulk, out_dev, skb);
+  }
+  skb_table_batch_flush(&released);
+  tx_bulk_flush(&bulk);
+  xspq_cons_release(queue);
+  if (queue->comp) {
+    xspq_prod_submit(queue->comp);
+  }
+  return nb_pkts;
 }
 
-// XSP present as a character device to the user space.
-static long xspdev_ioctl(struct file *file, unsigned int cmd,
-                         unsigned long arg);
-static int xspdev_open(struct inode *inode, struct file *file);
-static int xspdev_release(struct inode *inode, struct file *file);
-static int xspdev_mmap(struct file *filp, struct vm_area_struct *vma);
-static int major;
-static struct class *xspdev_class;
-static struct cdev xspdev_cdev;
-static struct file_operations xsp_fops = {
-    .owner = THIS_MODULE,
-    .unlocked_ioctl = xspdev_ioctl,
-    .open = xspdev_open,
-    .release = xspdev_release,
-    .mmap = xspdev_mmap,
+// Tx rings of devices bound with XSP_BIND_TX_POLL are drained by a kernel
+// thread of the NUMA node of the device instead of IOCTL_SEND. It spins over
+// its rings while they are busy, and after tx_poll_idle_usecs without
+// descriptors marks them with XSP_RING_NEED_WAKEUP and sleeps until
+// userspace kicks it.
+struct tx_poller {
+  struct task_struct *task;
+  int node;
 };
 
-int xspdev_open(struct inode *inode, struct file *file) {
-  pr_info("xspdev_open\n");
-  return 0;
+static struct tx_poller *tx_pollers[MAX_NUMNODES];
+
+#define FOR_EACH_POLLED_QUEUE(poller, entry, j, queue)                         \
+  FOR_EACH_BOUND_DEV(entry)                                                    \
+  if (READ_ONCE(entry->tx_poller) == poller)                                   \
+    FOR_EACH_QUEUE(entry->tx_queue_array, j)                                   \
+  if ((queue = entry->tx_queue_array->queue[j]))
+
+// Drain every tx ring of poller, returns true if any had descriptors.
+static bool tx_poller_run(struct tx_poller *poller) {
+  struct dev_queue_entry *entry = NULL;
+  struct xsp_queue *queue = NULL;
+  bool busy = false;
+
+  rcu_read_lock();
+  FOR_EACH_POLLED_QUEUE(poller, entry, j, queue) {
+    if (xspq_prod_num(queue)) {
+      handle_send(entry, queue);
+      busy = true;
+    }
+  }
+  rcu_read_unlock();
+  return busy;
 }
 
-static int xspdev_release(struct inode *inode, struct file *file) {
-  pr_info("xspdev_release\n");
+// Mark the tx rings of poller as (not) needing a kick, returns true if any
+// has descriptors.
+static bool tx_poller_set_need_wakeup(struct tx_poller *poller, bool need) {
+  struct dev_queue_entry *entry = NULL;
+  struct xsp_queue *queue = NULL;
+  bool pending = false;
+
+  rcu_read_lock();
+  FOR_EACH_POLLED_QUEUE(poller, entry, j, queue) {
+    if (need) {
+      xspq_set_need_wakeup(queue);
+    } else {
+      xspq_clear_need_wakeup(queue);
+    }
+  }
+  // Pairs with the barrier of userspace between submitting descriptors and
+  // checking XSP_RING_NEED_WAKEUP
+  smp_mb();
+  FOR_EACH_POLLED_QUEUE(poller, entry, j, queue) {
+    if (xspq_prod_num(queue)) {
+      pending = true;
+      break;
+    }
+  }
+  rcu_read_unlock();
+  return pending;
+}
+
+static int tx_poller_fn(void *data) {
+  struct tx_poller *poller = data;
+  u64 idle_start = ktime_get_ns();
+
+  while (!kthread_should_stop()) {
+    if (tx_poller_run(poller)) {
+      idle_start = ktime_get_ns();
+      cond_resched();
+      continue;
+    }
+    u64 idle_ns = (u64)READ_ONCE(tx_poll_idle_usecs) * NSEC_PER_USEC;
+    if (ktime_get_ns() - idle_start < idle_ns) {
+      cond_resched();
+      continue;
+    }
+
+    set_current_state(TASK_INTERRUPTIBLE);
+    if (!tx_poller_set_need_wakeup(poller, true) && !kthread_should_stop()) {
+      schedule();
+    }
+    __set_current_state(TASK_RUNNING);
+    tx_poller_set_need_wakeup(poller, false);
+    idle_start = ktime_get_ns();
+  }
   return 0;
 }
 
-static int xspdev_mmap(struct file *filp, struct vm_area_struct *vma) {
-  loff_t offset = (loff_t)vma->vm_pgoff << PAGE_SHIFT;
-  unsigned long size = vma->vm_end - vma->vm_start;
-  struct offset_queue_entry *entry = NULL;
-  struct xsp_queue *q = NULL;
+static void tx_poller_kick(struct tx_poller *poller) {
+  wake_up_process(poller->task);
+}
 
-  entry = offset_queue_table_lookup(&global_offset_queue_table, offset);
+// Poller of a NUMA node, created on first use. Called with bind_lock held.
+static struct tx_poller *tx_poller_get(int node) {
+  struct tx_poller *poller = tx_pollers[node];
+  const struct cpumask *mask = cpumask_of_node(node);
 
-  if (!entry || !entry->queue) {
-    pr_err("invalid entry with offset: %llu", offset);
-    return -EINVAL;
+  if (poller) {
+    return poller;
   }
-  q = entry->queue;
-  pr_info("offset: %llu size: %lu queue size: %lu", offset, size,
-          q->ring_vmalloc_size);
+  poller = kzalloc_node(sizeof(*poller), GFP_KERNEL, node);
+  if (!poller) {
+    return NULL;
+  }
+  poller->node = node;
+  poller->task = kthread_create_on_node(tx_poller_fn, poller, node,
+                                        "xsp_txpoll/%d", node);
+  if (IS_ERR(poller->task)) {
+    kfree(poller);
+    return NULL;
+  }
+  if (cpumask_intersects(mask, cpu_online_mask)) {
+    set_cpus_allowed_ptr(poller->task, mask);
+  }
+  tx_pollers[node] = poller;
+  wake_up_process(poller->task);
+  return poller;
+}
 
-  /* Matches the smp_wmb() in xsk_init_queue */
-  smp_rmb();
-  if (size > q->ring_vmalloc_size)
-    return -EINVAL;
+static void tx_pollers_stop(void) {
+  for (int node = 0; node < MAX_NUMNODES; node++) {
+    if (tx_pollers[node]) {
+      kthread_stop(tx_pollers[node]->task);
+      kfree(tx_pollers[node]);
+      tx_pollers[node] = NULL;
+    }
+  }
+}
 
-  int ret = remap_vmalloc_range(vma, q->addrs, 0);
-  if (ret) {
-    pr_err("failed to mmap with offset %lld \n", offset);
+// Drain the tx queue at offset, or kick its poller. Returns the number of
+// descriptors read. Called under rcu_read_lock(), like every sender, so that
+// unbinding can wait for the senders using the device. Rx and completion
+// rings are consumed by userspace and are rejected.
+static int send_queue(struct offset_queue_entry *offset_entry) {
+  struct dev_queue_entry *dev_entry = NULL;
+
+  if (!offset_entry->tx || !offset_entry->queue) {
+    return -EINVAL;
   }
+  dev_entry =
+      dev_queue_table_lookup(&global_dev_queue_table, offset_entry->dev);
+  if (!dev_entry) {
+    return -EINVAL;
+  }
+  if (dev_entry->tx_poller) {
+    tx_poller_kick(dev_entry->tx_poller);
+    return 0;
+  }
+  return handle_send(dev_entry, offset_entry->queue);
+}
 
-  return ret;
+// Send the tx queues userspace marked in the dirty region of a device.
+static void send_dirty(struct dev_queue_entry *entry) {
+  struct xsp_tx_dirty *dirty = entry->tx_dirty;
+  struct queue_array *tx_queue_array = entry->tx_queue_array;
+
+  if (!READ_ONCE(dirty->summary)) {
+    return;
+  }
+  // Bits are cleared before the rings are read, a ring marked again
+  // meanwhile is sent by the next call.
+  u64 summary = xchg(&dirty->summary, 0);
+  while (summary) {
+    u32 word = __ffs64(summary);
+    summary &= summary - 1;
+    if (word >= ARRAY_SIZE(dirty->words)) {
+      break;
+    }
+    u64 bits = xchg(&dirty->words[word], 0);
+    while (bits) {
+      u32 i = word * 64 + __ffs64(bits);
+      bits &= bits - 1;
+      if (i < tx_queue_array->size) {
+        handle_send(entry, tx_queue_array->queue[i]);
+      }
+    }
+  }
 }
 
-static int bind_dev(void *user_info_addr) {
-  struct bind_dev_info info;
-  int ret;
-  if (copy_from_user(&info, (struct bind_dev_info *)user_info_addr,
+// Set the members of a port group, they must be devices bound through ctx.
+static int update_port_group(struct xsp_ctx *ctx, void *user_info_addr) {
+  struct port_group_info info;
+  struct net_device **devs = NULL;
+  u32 *ifindexes = NULL;
+  int ret = 0;
+
+  if (copy_from_user(&info, (struct port_group_info *)user_info_addr,
                      sizeof(info))) {
     pr_err("copy_from_user failed\n");
     return -EFAULT;
   }
-  // Get the device by name
-  struct net_device *dev = dev_get_by_name(&init_net, info.dev_name);
-  if (!dev) {
-    pr_err("Device not found by name: %s\n", info.dev_name);
-    return -ENODEV;
+  if (info.id >= XSP_PORT_GROUP_MAX || info.num > XSP_PORT_GROUP_MAX_PORTS) {
+    return -EINVAL;
   }
-
-  // Check if the device is already binded in dev queue table
-  if (dev_queue_table_lookup(&global_dev_queue_table, dev) != NULL) {
-    pr_err("Device is already binded in dev queue table\n");
-    return -EBUSY;
+  if (!info.num) {
+    return port_group_table_set(&ctx->port_groups, info.id, NULL, 0);
   }
 
-  // Create queue array for tx and rx
-  struct queue_array *tx_queue_array = queue_array_create(CORE_NUM);
-  struct queue_array *rx_queue_array = queue_array_create(CORE_NUM);
-  if (!tx_queue_array || !rx_queue_array) {
-    pr_err("Failed to create queue array\n");
-    return -ENOMEM;
+  ifindexes = memdup_user(u64_to_user_ptr(info.ifindexes),
+                          info.num * sizeof(u32));
+  if (IS_ERR(ifindexes)) {
+    return PTR_ERR(ifindexes);
+  }
+  devs = kcalloc(info.num, sizeof(*devs), GFP_KERNEL);
+  if (!devs) {
+    ret = -ENOMEM;
+    goto out;
+  }
+  // The members must stay bound until the group is in the table
+  mutex_lock(&bind_lock);
+  for (u32 i = 0; i < info.num; i++) {
+    struct net_device *dev = dev_get_by_index(&init_net, ifindexes[i]);
+    if (!dev) {
+      pr_err("Device not found by index: %u\n", ifindexes[i]);
+      ret = -ENODEV;
+      goto unlock;
+    }
+    // Like flows, groups only refer to bound devices and hold no reference
+    bool bound = dev_bound_by(ctx, dev);
+    dev_put(dev);
+    if (!bound) {
+      ret = -EINVAL;
+      goto unlock;
+    }
+    devs[i] = dev;
   }
+  ret = port_group_table_set(&ctx->port_groups, info.id, devs, info.num);
 
-  // Add queue array to queue array list
-  queue_array_list_insert(&global_queue_array_list, tx_queue_array);
-  queue_array_list_insert(&global_queue_array_list, rx_queue_array);
+unlock:
+  mutex_unlock(&bind_lock);
+out:
+  kfree(devs);
+  kfree(ifindexes);
+  return ret;
+}
 
-  // Insert queue array to dev queue table
-  dev_queue_table_insert(&global_dev_queue_table, dev, tx_queue_array,
-                         rx_queue_array);
+// The rx queue mapped at offset, NULL if the offset is not the one of a
+// present rx queue. Called with ctx->lock held.
+static struct xsp_queue *rx_queue_at(struct xsp_ctx *ctx, u64 offset) {
+  struct dev_queue_entry *entry = NULL;
 
-  // Assign offset to each queue and add to offset queue table
-  loff_t offset =
-      offset_queue_fetch_next(&global_offset_queue_table, CORE_NUM * 2);
-  loff_t tx_offset_start = offset;
-  loff_t rx_offset_start = offset;
-  struct xsp_queue *queue = NULL;
-  FOR_EACH_QUEUE(tx_queue_array, i) {
-    queue = tx_queue_array->queue[i];
-    offset_queue_table_insert(&global_offset_queue_table, offset, dev, queue);
-    offset += PAGE_SIZE;
+  if (!PAGE_ALIGNED(offset)) {
+    return NULL;
   }
-  rx_offset_start = offset;
-  FOR_EACH_QUEUE(rx_queue_array, i) {
-    queue = rx_queue_array->queue[i];
-    offset_queue_table_insert(&global_offset_queue_table, offset, dev, queue);
-    offset += PAGE_SIZE;
+  FOR_EACH_CTX_DEV(ctx, entry) {
+    // Members of a rx group share the queues of its first device
+    if (entry->rx_owner || offset < entry->rx_start_offset) {
+      continue;
+    }
+    u64 i = (offset - entry->rx_start_offset) >> PAGE_SHIFT;
+    if (i < entry->rx_queue_array->size) {
+      return READ_ONCE(entry->rx_queue_array->queue[i]);
+    }
   }
+  return NULL;
+}
 
-  // Set rx handler for the device
-  rtnl_lock();
-  ret = netdev_rx_handler_register(dev, xsp_handle_frame, rx_queue_array);
-  rtnl_unlock();
-  if (ret) {
-    pr_err("register %s rx handle, result: %d", info.dev_name, ret);
-    return ret;
-  }
+static int set_rx_eventfd(struct xsp_ctx *ctx, void *user_info_addr) {
+  struct rx_eventfd_info info;
+  struct eventfd_ctx *eventfd = NULL;
+  struct xsp_queue *queue = NULL;
+  int ret = -EINVAL;
 
-  // Copy out argruments into info
-  info.step = PAGE_SIZE;
-  info.rx_start_offset = rx_offset_start;
-  info.rx_queue_num = CORE_NUM;
-  info.rx_queue_size = rx_queue_array->queue[0]->ring_vmalloc_size;
-  info.tx_start_offset = tx_offset_start;
-  info.tx_queue_num = CORE_NUM;
-  info.tx_queue_size = tx_queue_array->queue[0]->ring_vmalloc_size;
-  ret = copy_to_user(user_info_addr, &info, sizeof(struct bind_dev_info));
+  if (copy_from_user(&info, (struct rx_eventfd_info *)user_info_addr,
+                     sizeof(info))) {
+    pr_err("copy_from_user failed\n");
+    return -EFAULT;
+  }
+  eventfd = eventfd_ctx_fdget(info.fd);
+  if (IS_ERR(eventfd)) {
+    return PTR_ERR(eventfd);
+  }
+  // Unbinding unlinks the device under ctx->lock before it destroys the
+  // queues, which puts their eventfd
+  mutex_lock(&ctx->lock);
+  queue = rx_queue_at(ctx, info.offset);
+  if (queue) {
+    ret = cmpxchg(&queue->eventfd, NULL, eventfd) ? -EBUSY : 0;
+  }
+  mutex_unlock(&ctx->lock);
   if (ret) {
-    pr_err("copy_to_user failed %d \n", ret);
+    eventfd_ctx_put(eventfd);
   }
-
-  pr_info("bind dev %s successfully\n", info.dev_name);
   return ret;
 }
 
-static inline int handle_send(struct net_device *dev, struct xsp_queue *queue) {
-  if (!dev || !queue) {
-    pr_err("Error in offset table");
+#define SEND_BATCH_CHUNK 32
+
+static int send_batch(struct xsp_ctx *ctx, void *user_info_addr) {
+  struct send_batch_info info;
+  u64 offsets[SEND_BATCH_CHUNK];
+  s32 counts[SEND_BATCH_CHUNK];
+
+  if (copy_from_user(&info, (struct send_batch_info *)user_info_addr,
+                     sizeof(info))) {
+    pr_err("copy_from_user failed\n");
+    return -EFAULT;
+  }
+  if (info.num > XSP_SEND_BATCH_MAX) {
     return -EINVAL;
   }
-  u32 nb_pkts = xspq_cons_nb_entries(queue, 4096);
-  for (u32 i = 0; i < nb_pkts; i++) {
-    u64 addr;
-    bool ret = xspq_cons_read_addr_unchecked_inc(queue, &addr);
-    BUG_ON(!ret);
 
-    // xmit the packet to dev
-    struct sk_buff *skb = (struct sk_buff *)addr;
-    if (IS_ERR(skb) || refcount_read(&skb->users) != 1) {
-      pr_err("Err in send packet");
-      continue;
-    }
-    skb->dev = dev;
-    if (netpoll_tx_running(skb->dev)) {
-      printk("fail xmit: dev busy\n");
-      consume_skb(skb);
-      continue;
+  u64 __user *user_offsets = u64_to_user_ptr(info.offsets);
+  s32 __user *user_counts = u64_to_user_ptr(info.counts);
+  for (u64 done = 0; done < info.num;) {
+    u32 n = min_t(u64, info.num - done, SEND_BATCH_CHUNK);
+    if (copy_from_user(offsets, user_offsets + done, n * sizeof(u64))) {
+      return -EFAULT;
     }
-    if (!is_skb_forwardable(skb->dev, skb)) {
-      printk("fail forward: \n");
-      consume_skb(skb);
-      continue;
+    rcu_read_lock();
+    for (u32 i = 0; i < n; i++) {
+      struct offset_queue_entry *offset_entry =
+          offset_queue_table_lookup(&ctx->offsets, offsets[i]);
+      counts[i] = offset_entry ? send_queue(offset_entry) : -EINVAL;
     }
-    skb_push(skb, ETH_HLEN);
-    if (dev_queue_xmit(skb) == NETDEV_TX_BUSY) {
-      consume_skb(skb);
+    rcu_read_unlock();
+    if (user_counts &&
+        copy_to_user(user_counts + done, counts, n * sizeof(s32))) {
+      return -EFAULT;
     }
+    done += n;
   }
-  xspq_cons_release(queue);
   return 0;
 }
 
 static long xspdev_ioctl(struct file *file, unsigned int cmd,
                          unsigned long arg) {
+  struct xsp_ctx *ctx = file->private_data;
   struct offset_queue_entry *offset_entry = NULL;
   struct dev_queue_entry *dev_queue_entry = NULL;
+  int ret;
   switch (cmd) {
   case IOCTL_BIND_DEV:
-    return bind_dev((void *)arg);
+    return bind_dev(ctx, (void *)arg);
+  case IOCTL_UNBIND_DEV:
+    return unbind_dev(ctx, (void *)arg);
   case IOCTL_SEND:
-    offset_entry = offset_queue_table_lookup(&global_offset_queue_table, arg);
+    rcu_read_lock();
+    offset_entry = offset_queue_table_lookup(&ctx->offsets, arg);
+    ret = offset_entry ? send_queue(offset_entry) : -EINVAL;
+    rcu_read_unlock();
     if (!offset_entry) {
       pr_err("Failed to lookup queue by offset %lld\n", (u64)arg);
-      return -EINVAL;
     }
-    return handle_send(offset_entry->dev, offset_entry->queue);
+    return ret < 0 ? ret : 0;
+  case IOCTL_SEND_BATCH:
+    return send_batch(ctx, (void *)arg);
   case IOCTL_SEND_ALL:
-    for (int i = 0; i < DEV_QUEUE_TABLE_SIZE; i++) {
-      hlist_for_each_entry_rcu(
-          dev_queue_entry, &(global_dev_queue_table.buckets[i]), hlist_node) {
-        FOR_EACH_QUEUE(dev_queue_entry->tx_queue_array, j) {
-          handle_send(dev_queue_entry->dev,
-                      dev_queue_entry->tx_queue_array->queue[j]);
-        }
+    rcu_read_lock();
+    FOR_EACH_CTX_DEV(ctx, dev_queue_entry) {
+      if (dev_queue_entry->tx_poller) {
+        tx_poller_kick(dev_queue_entry->tx_poller);
+        continue;
+      }
+      if (dev_queue_entry->tx_dirty) {
+        send_dirty(dev_queue_entry);
+        continue;
+      }
+      FOR_EACH_QUEUE(dev_queue_entry->tx_queue_array, j) {
+        handle_send(dev_queue_entry, dev_queue_entry->tx_queue_array->queue[j]);
       }
     }
+    rcu_read_unlock();
     break;
+  case IOCTL_FLOW_ADD:
+    return update_flow(ctx, (void *)arg, true);
+  case IOCTL_FLOW_DEL:
+    return update_flow(ctx, (void *)arg, false);
+  case IOCTL_PORT_GROUP_SET:
+    return update_port_group(ctx, (void *)arg);
+  case IOCTL_RX_EVENTFD:
+    return set_rx_eventfd(ctx, (void *)arg);
   default:
     pr_err("Unknown ioctl cmd: %u", cmd);
     return -EINVAL;
@@ -304,9 +2594,39 @@ static int __init xsp_init(void) {
   device_create(xspdev_class, NULL, MKDEV(major, 0), NULL, DEVICE_NAME);
 
   // Initialize related data structure
-  queue_array_list_init(&global_queue_array_list);
+  int cpu;
+  for_each_possible_cpu(cpu) {
+    tasklet_setup(&per_cpu(rx_batch, cpu).flush_tasklet,
+                  rx_batch_flush_tasklet);
+    INIT_WORK(&per_cpu(rx_batch, cpu).drain_work, rx_batch_drain_fn);
+  }
   dev_queue_table_init(&global_dev_queue_table);
-  offset_queue_table_init(&global_offset_queue_table);
+  flow_table_init(&global_flow_table);
+
+  // Rx queues follow the online cpus
+  ret = cpuhp_setup_state_nocalls(CPUHP_AP_ONLINE_DYN, "net/xsp:online",
+                                  xsp_cpu_online, xsp_cpu_offline);
+  if (ret < 0) {
+    pr_err("Failed to register cpu hotplug callbacks\n");
+    device_destroy(xspdev_class, MKDEV(major, 0));
+    cdev_del(&xspdev_cdev);
+    class_destroy(xspdev_class);
+    unregister_chrdev_region(MKDEV(major, 0), 1);
+    return ret;
+  }
+  xsp_cpuhp_state = ret;
+
+  // Bound devices are unbound when they go away
+  ret = register_netdevice_notifier(&xsp_netdev_notifier);
+  if (ret) {
+    pr_err("Failed to register netdev notifier\n");
+    cpuhp_remove_state_nocalls(xsp_cpuhp_state);
+    device_destroy(xspdev_class, MKDEV(major, 0));
+    cdev_del(&xspdev_cdev);
+    class_destroy(xspdev_class);
+    unregister_chrdev_region(MKDEV(major, 0), 1);
+    return ret;
+  }
 
   pr_info("xsp module initialized\n");
 
@@ -318,18 +2638,21 @@ static void __exit xsp_exit(void) {
   // Prevent other operation to execute here so that we can destory resource
   // safely.
 
-  // Unregister rx handler
-  struct dev_queue_entry *entry = NULL;
-  struct hlist_node *tmp;
-  for (int i = 0; i < DEV_QUEUE_TABLE_SIZE; i++) {
-    hlist_for_each_entry_safe(entry, tmp, &global_dev_queue_table.buckets[i],
-                              hlist_node) {
-      rtnl_lock();
-      netdev_rx_handler_unregister(entry->dev);
-      rtnl_unlock();
-      dev_put(entry->dev);
-      pr_info("Unregister device rx handler%s\n", entry->dev->name);
-    }
+  cpuhp_remove_state_nocalls(xsp_cpuhp_state);
+  unregister_netdevice_notifier(&xsp_netdev_notifier);
+
+  // Open files hold the module, so every file was released and unbound its
+  // devices before we get here.
+  tx_pollers_stop();
+
+  // Flows only refer to bound devices
+  flow_table_clear(&global_flow_table);
+
+  // No rx handler runs anymore, make sure no batch flush is pending on any
+  // queue before they are destroyed.
+  int cpu;
+  for_each_possible_cpu(cpu) {
+    tasklet_kill(&per_cpu(rx_batch, cpu).flush_tasklet);
   }
 
   // Destory device
@@ -338,12 +2661,8 @@ static void __exit xsp_exit(void) {
   cdev_del(&xspdev_cdev);
   unregister_chrdev_region(MKDEV(major, 0), 1);
 
-  // Destroy queue
-  queue_array_list_destroy(&global_queue_array_list);
-
   // Clear table
   dev_queue_table_clear(&global_dev_queue_table);
-  offset_queue_table_clear(&global_offset_queue_table);
 
   pr_info("xsp module exit\n");
 }
@@ -7,18 +7,25 @@
 #ifndef _LINUX_XSP_QUEUE_H
 #define _LINUX_XSP_QUEUE_H
 
+#include "common_config.h"
+#include <linux/eventfd.h>
+#include <linux/hrtimer.h>
 #include <linux/if_xdp.h>
+#include <linux/log2.h>
 #include <linux/mm.h>
 #include <linux/overflow.h>
 #include <linux/smp.h>
+#include <linux/spinlock.h>
 #include <linux/types.h>
 #include <linux/vmalloc.h>
+#include <linux/wait.h>
 
-struct ring_entry {
-  u64 addr;
-  u64 src_mac;
-  u64 dst_mac;
-};
+/* Bits of xsp_ring.flag */
+
+/* The consumer is (about to go) asleep and wants the producer to wake it
+ * up once new entries are published.
+ */
+#define XSP_RING_NEED_WAKEUP (1 << 0)
 
 struct xsp_ring {
   u32 producer __attribute__((__aligned__((1 << (6)))));
@@ -30,23 +37,57 @@ struct xsp_ring {
   u32 pad2 __attribute__((__aligned__((1 << (6)))));
   u32 nentries;
   u32 flag;
+  /* Bytes between two entries, see xspq_desc() */
+  u32 desc_size;
   u32 pad3 __attribute__((__aligned__((1 << (6)))));
 };
 
+/* Entries are one of the descriptors of XSP_DESC_FORMAT_*, desc_size
+ * apart. Every format starts with the handle of struct ring_entry, the
+ * other fields of ring_entry are only there in the larger ones.
+ */
 struct xsp_ring_buffer {
   struct xsp_ring ptrs;
   struct ring_entry addrs[] __attribute__((__aligned__((1 << (6)))));
 };
 
+struct skb_table;
+
 struct xsp_queue {
   u32 ring_mask;
   u32 nentries;
+  u32 desc_size;
   u32 cached_prod;
   u32 cached_cons;
+  /* Producer index last made visible to the consumer. It lags behind
+   * cached_prod while the producer is building a batch.
+   */
+  u32 published_prod;
   struct xsp_ring *addrs;
-  u64 invalid_descs;
-  u64 queue_empty_descs;
+  /* Counters shared with userspace, set up by the owner of the queue */
+  struct xsp_queue_stats *stats;
+  /* Skbs handed to userspace, by a rx queue or by a tx queue returning
+   * them for a retry. Set up by the owner.
+   */
+  struct skb_table *skb_table;
+  /* Completion ring of a tx queue, NULL if it has none */
+  struct xsp_queue *comp;
   size_t ring_vmalloc_size;
+  /* NUMA node the ring was allocated on, NUMA_NO_NODE if any */
+  int node;
+  /* Sleeping consumers, see xspq_need_wakeup() */
+  wait_queue_head_t wait;
+  /* Signalled along with wait, set at most once by the owner and put when
+   * the queue is destroyed.
+   */
+  struct eventfd_ctx *eventfd;
+  struct hrtimer wakeup_timer;
+  u32 wakeup_pending;
+  /* Set if several cpus produce into the queue, they serialize on
+   * prod_lock. Queues with a single producer never take it.
+   */
+  bool shared_prod;
+  spinlock_t prod_lock;
 };
 
 /* The structure of the shared state of the rings are a simple
@@ -111,14 +152,21 @@ struct xsp_queue {
  * The function names below reflect these operations.
  */
 
+/* Entry idx of the ring. Only addr is valid for every format, the macs
+ * are not there in descriptors smaller than struct ring_entry.
+ */
+static inline struct ring_entry *xspq_desc(struct xsp_queue *q, u32 idx) {
+  struct xsp_ring_buffer *ring = (struct xsp_ring_buffer *)q->addrs;
+
+  return (struct ring_entry *)((char *)ring->addrs +
+                               (size_t)(idx & q->ring_mask) * q->desc_size);
+}
+
 /* Functions for consumers */
 
 static inline void __xspq_cons_read_addr_unchecked(struct xsp_queue *q,
                                                    u32 cached_cons, u64 *addr) {
-  struct xsp_ring_buffer *ring = (struct xsp_ring_buffer *)q->addrs;
-  u32 idx = cached_cons & q->ring_mask;
-
-  *addr = ring->addrs[idx].addr;
+  *addr = xspq_desc(q, cached_cons)->addr;
 }
 
 static inline bool xspq_cons_read_addr_unchecked(struct xsp_queue *q,
@@ -134,6 +182,13 @@ static inline bool xspq_cons_read_addr_unchecked_inc(struct xsp_queue *q,
   return ret;
 }
 
+/* Copy the next entry into desc, which has room for desc_size bytes */
+static inline void xspq_cons_read_desc_unchecked_inc(struct xsp_queue *q,
+                                                     void *desc) {
+  memcpy(desc, xspq_desc(q, q->cached_cons), q->desc_size);
+  q->cached_cons++;
+}
+
 static inline void __xspq_cons_release(struct xsp_queue *q) {
   smp_store_release(&q->addrs->consumer, q->cached_cons); /* D, matchees A */
 }
@@ -178,24 +233,38 @@ static inline bool xspq_prod_is_full(struct xsp_queue *q) {
   return xspq_prod_nb_free(q, 1) ? false : true;
 }
 
+/* Queue of struct ring_entry only */
 static inline int xspq_prod_reserve_addr(struct xsp_queue *q, u64 addr,
                                          u64 src_mac, u64 dst_mac) {
-  struct xsp_ring_buffer *ring = (struct xsp_ring_buffer *)q->addrs;
+  struct ring_entry *entry;
 
   if (xspq_prod_is_full(q))
     return -ENOSPC;
 
   /* A, matches D */
-  u32 ori_cached_prod = q->cached_prod;
-  ring->addrs[ori_cached_prod & q->ring_mask].addr = addr;
-  ring->addrs[ori_cached_prod & q->ring_mask].src_mac = src_mac;
-  ring->addrs[ori_cached_prod & q->ring_mask].dst_mac = dst_mac;
+  entry = xspq_desc(q, q->cached_prod);
+  entry->addr = addr;
+  entry->src_mac = src_mac;
+  entry->dst_mac = dst_mac;
   q->cached_prod++;
 
   return 0;
 }
 
+/* Reserve the next entry of the ring and return it, the caller fills in
+ * all desc_size bytes of it before it is submitted. NULL if the ring is
+ * full.
+ */
+static inline void *xspq_prod_reserve_desc(struct xsp_queue *q) {
+  if (xspq_prod_is_full(q))
+    return NULL;
+
+  /* A, matches D */
+  return xspq_desc(q, q->cached_prod++);
+}
+
 static inline void __xspq_prod_submit(struct xsp_queue *q, u32 idx) {
+  q->published_prod = idx;
   smp_store_release(&q->addrs->producer, idx); /* B, matches C */
 }
 
@@ -203,40 +272,123 @@ static inline void xspq_prod_submit(struct xsp_queue *q) {
   __xspq_prod_submit(q, q->cached_prod);
 }
 
+/* Batched producer API.
+ *
+ * Reserving only advances the private cached_prod, so a producer can write
+ * a whole batch of entries with xspq_prod_reserve_desc() and make them
+ * visible to the consumer with a single xspq_prod_submit() instead of one
+ * per entry, as the rx handler does.
+ */
+
+static inline u32 xspq_prod_nb_unpublished(struct xsp_queue *q) {
+  return q->cached_prod - q->published_prod;
+}
+
 static inline size_t xspq_prod_num(struct xsp_queue *q) {
   return READ_ONCE(q->addrs->producer) - READ_ONCE(q->addrs->consumer);
 }
 
+/* Consumer wakeup.
+ *
+ * A consumer that wants to sleep sets XSP_RING_NEED_WAKEUP, issues a full
+ * barrier and checks the ring once more before it sleeps on q->wait. A
+ * producer publishes, issues a full barrier and then checks the flag, so
+ * at least one side always sees the other.
+ */
+
+static inline bool xspq_need_wakeup(struct xsp_queue *q) {
+  return READ_ONCE(q->addrs->flag) & XSP_RING_NEED_WAKEUP;
+}
+
+static inline void xspq_set_need_wakeup(struct xsp_queue *q) {
+  if (!xspq_need_wakeup(q))
+    WRITE_ONCE(q->addrs->flag, q->addrs->flag | XSP_RING_NEED_WAKEUP);
+}
+
+static inline void xspq_clear_need_wakeup(struct xsp_queue *q) {
+  if (xspq_need_wakeup(q))
+    WRITE_ONCE(q->addrs->flag, q->addrs->flag & ~XSP_RING_NEED_WAKEUP);
+}
+
+static inline void xspq_wakeup(struct xsp_queue *q) {
+  struct eventfd_ctx *eventfd = READ_ONCE(q->eventfd);
+
+  WRITE_ONCE(q->wakeup_pending, 0);
+  xspq_clear_need_wakeup(q);
+  wake_up_interruptible(&q->wait);
+  if (eventfd)
+    eventfd_signal(eventfd);
+}
+
+static enum hrtimer_restart xspq_wakeup_timer_fn(struct hrtimer *timer) {
+  struct xsp_queue *q = container_of(timer, struct xsp_queue, wakeup_timer);
+
+  xspq_wakeup(q);
+  return HRTIMER_NORESTART;
+}
+
 /* For both producers and consumers */
 struct xsp_queue *xspq_create(u32 nentries);
+struct xsp_queue *xspq_create_desc(u32 nentries, u32 desc_size);
+struct xsp_queue *xspq_create_desc_node(u32 nentries, u32 desc_size, int node);
 void xspq_destroy(struct xsp_queue *q);
 
 static size_t xspq_get_ring_size(struct xsp_queue *q) {
-  struct xsp_ring_buffer *ring_buffer;
+  return size_add(offsetof(struct xsp_ring_buffer, addrs),
+                  size_mul(q->nentries, q->desc_size));
+}
 
-  return struct_size(ring_buffer, addrs, q->nentries);
+/* Whether a queue of nentries can be created */
+static inline bool xspq_nentries_valid(u64 nentries) {
+  return nentries && nentries <= XSP_RING_MAX_DEPTH && is_power_of_2(nentries);
+}
+
+/* Size of the memory backing (and mapped for) a queue of nentries entries
+ * desc_size bytes each
+ */
+static inline size_t xspq_size_for(u32 nentries, u32 desc_size) {
+  return PAGE_ALIGN(size_add(offsetof(struct xsp_ring_buffer, addrs),
+                             size_mul(nentries, desc_size)));
 }
 
 struct xsp_queue *xspq_create(u32 nentries) {
-  if (!is_power_of_2(nentries)) {
+  return xspq_create_desc(nentries, sizeof(struct ring_entry));
+}
+
+/* Create a queue whose entries are desc_size bytes apart, desc_size must
+ * hold at least the handle.
+ */
+struct xsp_queue *xspq_create_desc(u32 nentries, u32 desc_size) {
+  return xspq_create_desc_node(nentries, desc_size, NUMA_NO_NODE);
+}
+
+/* Like xspq_create_desc(), with the ring on NUMA node node. The ring is
+ * touched for every entry by both sides, so it belongs on the node of its
+ * producer or consumer. It is not VM_USERMAP, map it page by page.
+ */
+struct xsp_queue *xspq_create_desc_node(u32 nentries, u32 desc_size,
+                                        int node) {
+  if (!xspq_nentries_valid(nentries) || desc_size < sizeof(u64) ||
+      desc_size % sizeof(u64)) {
     return NULL;
   }
 
   struct xsp_queue *q;
   size_t size;
 
-  q = kzalloc(sizeof(*q), GFP_KERNEL);
+  q = kzalloc_node(sizeof(*q), GFP_KERNEL, node);
   if (!q)
     return NULL;
 
   q->nentries = nentries;
   q->ring_mask = nentries - 1;
+  q->desc_size = desc_size;
 
   size = xspq_get_ring_size(q);
 
   /* size which is overflowing or close to SIZE_MAX will become 0 in
    * PAGE_ALIGN(), checking SIZE_MAX is enough due to the previous
-   * is_power_of_2(), the rest will be handled by vmalloc_user()
+   * is_power_of_2(), the rest will be handled by vzalloc_node()
    */
   if (unlikely(size == SIZE_MAX)) {
     kfree(q);
@@ -245,14 +397,20 @@ struct xsp_queue *xspq_create(u32 nentries) {
 
   size = PAGE_ALIGN(size);
 
-  q->addrs = vmalloc_user(size);
-  q->addrs->nentries = nentries;
+  q->addrs = vzalloc_node(size, node);
   if (!q->addrs) {
     kfree(q);
     return NULL;
   }
+  q->addrs->nentries = nentries;
+  q->addrs->desc_size = desc_size;
 
   q->ring_vmalloc_size = size;
+  q->node = node;
+  spin_lock_init(&q->prod_lock);
+  init_waitqueue_head(&q->wait);
+  hrtimer_setup(&q->wakeup_timer, xspq_wakeup_timer_fn, CLOCK_MONOTONIC,
+                HRTIMER_MODE_REL_SOFT);
   return q;
 }
 
@@ -260,6 +418,9 @@ void xspq_destroy(struct xsp_queue *q) {
   if (!q)
     return;
 
+  hrtimer_cancel(&q->wakeup_timer);
+  if (q->eventfd)
+    eventfd_ctx_put(q->eventfd);
   vfree(q->addrs);
   kfree(q);
 }
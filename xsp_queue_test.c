@@ -65,8 +65,85 @@ static int __init queue_test_init(void) {
     printk(KERN_ERR "Producer count: %u != %u\n", producer_count, TEST_ENTRIES);
   }
 
+  // Batched producer: entries stay invisible until they are submitted.
+  for (u64 i = 0; i < 3; i++) {
+    if (xspq_prod_reserve_addr(queue, 0x1 + i, 0, 0)) {
+      printk(KERN_ERR "Failed to reserve batch in queue\n");
+    }
+  }
+  if (xspq_prod_nb_unpublished(queue) != 3) {
+    printk(KERN_ERR "Unpublished count: %u != 3\n",
+           xspq_prod_nb_unpublished(queue));
+  }
+  consumer_count = xspq_cons_nb_entries(queue, 4);
+  if (consumer_count != 0) {
+    printk(KERN_ERR "Consumer sees unpublished entries: %u\n", consumer_count);
+  }
+  xspq_prod_submit(queue);
+  consumer_count = xspq_cons_nb_entries(queue, 4);
+  if (consumer_count != 3) {
+    printk(KERN_ERR "Consumer count after batch submit: %u != 3\n",
+           consumer_count);
+  }
+
+  xspq_destroy(queue);
+
+  // Extended descriptors: entries are desc_size apart and start with the
+  // fields of ring_entry.
+  queue = xspq_create_desc(TEST_ENTRIES, sizeof(struct xsp_rx_desc_ext));
+  if (!queue) {
+    printk(KERN_ERR "Failed to create queue with extended descriptors\n");
+    return -ENOMEM;
+  }
+  for (u64 i = 0; i < 2; i++) {
+    struct xsp_rx_desc_ext *desc = xspq_prod_reserve_desc(queue);
+    if (!desc) {
+      printk(KERN_ERR "Failed to reserve extended descriptor\n");
+      break;
+    }
+    desc->addr = 0x100 + i;
+    desc->len = 64 + i;
+  }
+  xspq_prod_submit(queue);
+  if (xspq_cons_nb_entries(queue, 4) != 2 ||
+      !xspq_cons_read_addr_unchecked_inc(queue, &addr1) ||
+      !xspq_cons_read_addr_unchecked_inc(queue, &addr2) || addr1 != 0x100 ||
+      addr2 != 0x101) {
+    printk(KERN_ERR "Wrong extended descriptors: %llx %llx\n", addr1, addr2);
+  }
+  xspq_destroy(queue);
+
+  // Compact descriptors only start with the handle
+  queue = xspq_create_desc(TEST_ENTRIES, sizeof(struct xsp_desc_compact));
+  if (!queue) {
+    printk(KERN_ERR "Failed to create queue with compact descriptors\n");
+    return -ENOMEM;
+  }
+  for (u64 i = 0; i < 2; i++) {
+    struct xsp_desc_compact *desc = xspq_prod_reserve_desc(queue);
+    if (!desc) {
+      printk(KERN_ERR "Failed to reserve compact descriptor\n");
+      break;
+    }
+    desc->addr = 0x200 + i;
+    desc->ifindex = 7;
+  }
+  xspq_prod_submit(queue);
+  if (xspq_cons_nb_entries(queue, 4) != 2 ||
+      !xspq_cons_read_addr_unchecked_inc(queue, &addr1) ||
+      !xspq_cons_read_addr_unchecked_inc(queue, &addr2) || addr1 != 0x200 ||
+      addr2 != 0x201) {
+    printk(KERN_ERR "Wrong compact descriptors: %llx %llx\n", addr1, addr2);
+  }
   xspq_destroy(queue);
 
+  // Descriptors must hold at least the handle
+  queue = xspq_create_desc(TEST_ENTRIES, sizeof(u32));
+  if (queue) {
+    printk(KERN_ERR "Queue with descriptors smaller than a handle created\n");
+    xspq_destroy(queue);
+  }
+
   printk(KERN_INFO "Queue test module initialized successfully\n");
   return 0;
 }